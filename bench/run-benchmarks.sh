@@ -0,0 +1,83 @@
+#!/bin/sh
+# Runs each benchmark in the host build and compares it with baseline.txt.
+# A benchmark is a program in this directory which ends with PRINT.
+# The programs in lib are stored with it, so that it can call them.
+#
+# Usage: sh bench/run-benchmarks.sh [--update]
+# --update writes the results to baseline.txt instead.
+# The exit status is 1 when a benchmark prints a different result.
+
+MODE=$1
+cd "$(dirname "$0")" || exit 1
+HOST=../chipos-host
+RESULTS=$(mktemp)
+DISPLAY_OUTPUT=$(mktemp)
+STATISTICS=$(mktemp)
+trap 'rm -f "$RESULTS" "$DISPLAY_OUTPUT" "$STATISTICS"' EXIT
+
+for PROGRAM in *.chp
+do
+	NAME=${PROGRAM%.chp}
+	set --
+	for LIBRARY in lib/*.chp
+	do
+		set -- "$@" -f "$LIBRARY"
+	done
+	if ! "$HOST" -q -s -t 600 -f "$PROGRAM" "$@" - run.buttons > "$DISPLAY_OUTPUT" 2> "$STATISTICS"
+	then
+		echo "$NAME did not finish" >&2
+		exit 1
+	fi
+	# The result is the first row of the display.
+	RESULT=$(sed -n '2s/^|\([^ |]*\).*/\1/p' "$DISPLAY_OUTPUT")
+	# time T us, N SPI transactions, N SPI bytes, heap N bytes
+	tr -d ',' < "$STATISTICS" | awk -v name="$NAME" -v result="$RESULT" '{print name, result, $2, $4, $7, $11}' >> "$RESULTS"
+done
+
+if [ "$MODE" = "--update" ]
+then
+	{
+		echo "# name result time_us spi_transactions spi_bytes heap_bytes"
+		cat "$RESULTS"
+	} > baseline.txt
+	cat baseline.txt
+	exit 0
+fi
+
+awk '
+function change(value, base)
+{
+	if (base == 0)
+	{
+		return "-"
+	}
+	return sprintf("%+.1f%%", (value - base) * 100 / base)
+}
+FNR == NR {
+	if ($1 != "#")
+	{
+		baseline[$1] = $0
+	}
+	next
+}
+BEGIN {
+	printf "%-10s %8s %12s %8s %8s %8s %10s %8s %6s %8s\n", "NAME", "RESULT", "TIME_US", "CHANGE", "SPI_TX", "CHANGE", "SPI_BYTES", "CHANGE", "HEAP", "CHANGE"
+}
+{
+	mark = ""
+	if (!($1 in baseline))
+	{
+		mark = " (no baseline)"
+	}
+	split(baseline[$1], base, " ")
+	if (mark == "" && $2 != base[2])
+	{
+		mark = " (expected " base[2] ")"
+		status = 1
+	}
+	printf "%-10s %8s %12d %8s %8d %8s %10d %8s %6d %8s%s\n", $1, $2, $3, change($3, base[3]), $4, change($4, base[4]), $5, change($5, base[5]), $6, change($6, base[6]), mark
+}
+END {
+	exit status
+}
+' baseline.txt "$RESULTS"
@@ -0,0 +1,730 @@
+
+// Runs CHIPOS on the host. main.c is built with HOST_BUILD set, and its
+// pins, SPI bus, timer and delays are routed to the models below.
+//
+// Usage: chipos-host [-f FILE]... [-o OUTPUT] [-t SECONDS] [-q] [-s] EEPROM SCRIPT
+//
+// EEPROM is a flat image of the 128 KB EEPROM, or - for an empty one.
+// Shorter images are padded with 0xFF, which marks empty file entries.
+// Each -f stores a program in the next empty file entry. The name of the
+// file is the name of FILE without its directory and extension. SCRIPT holds the buttons to
+// press, separated by whitespace: LEFT, RIGHT, UP, DOWN, RETURN and ESCAPE.
+// A button may be followed by *N to press it N times. WAIT N lets N
+// milliseconds pass. Text from # to the end of the line is ignored.
+//
+// A press starts when the device waits for a button, and the display is
+// printed before each press. The simulation ends when the device waits
+// and the script is done. The final display is printed, and the EEPROM
+// is written to OUTPUT if it is given.
+//
+// Time is virtual. Only delays, SPI transfers and waiting take time, so
+// the time of a run does not depend on the speed of the host. With -s,
+// the time, the SPI traffic and the heap size of the last program run
+// are printed to stderr. Time spent waiting for buttons is not counted.
+// Exit status is 0 when the script is done, 1 on errors, and 2 when the
+// virtual time limit of -t is reached.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "host.h"
+
+#define SRAM_SIZE 32768
+#define EEPROM_SIZE 131072
+#define EEPROM_PAGE_SIZE 256
+#define EEPROM_FILE_ENTRY_SIZE 4096
+#define EEPROM_FILE_DATA_OFFSET 17
+#define MAXIMUM_FILE_NAME_LENGTH 16
+#define DISPLAY_MEMORY_SIZE 128
+#define DISPLAY_ROW_ADDRESS 0x40
+#define DISPLAY_WIDTH 16
+
+// Times are in microseconds.
+#define TIMER_TICK_TIME 1000
+// Eight bits of the bit-banged bus at about 8 cycles each when the bit
+// loops are unrolled, and 12 otherwise. Matches SPI_BYTE_TIME in main.c.
+#if ENABLE_UNROLLED_SPI
+#define SPI_BYTE_TIME 8
+#else
+#define SPI_BYTE_TIME 12
+#endif
+#define EEPROM_WRITE_TIME 3000
+#define BUTTON_HOLD_TIME 30000
+#define BUTTON_RELEASE_TIME 30000
+
+#define MAXIMUM_NUMBER_OF_SCRIPT_STEPS 65536
+#define WAIT_SCRIPT_STEP 0
+
+#define IDLE_BUTTON_STATE 0
+#define HOLDING_BUTTON_STATE 1
+#define RELEASING_BUTTON_STATE 2
+#define WAITING_BUTTON_STATE 3
+
+volatile uint8_t SREG = 0;
+volatile uint8_t TCCR0A = 0;
+volatile uint8_t TCCR0B = 0;
+volatile uint8_t OCR0A = 0;
+volatile uint8_t TIMSK = 0;
+volatile uint8_t TIFR = 0;
+
+static uint64_t currentTime = 0;
+static uint64_t nextTickTime = TIMER_TICK_TIME;
+static uint64_t timeLimit = 0;
+
+static uint8_t selectedSpiDevice = 0;
+static uint32_t spiByteIndex = 0;
+static uint8_t spiInstruction = 0;
+static uint32_t spiAddress = 0;
+
+// Totals are kept for the whole simulation. A run is measured from
+// the totals when it starts.
+typedef struct
+{
+	uint64_t busyTime;
+	uint32_t spiTransactionCount;
+	uint32_t spiTransferCount;
+	int heapSize;
+} Statistics;
+
+static Statistics totalStatistics;
+static Statistics runStatistics;
+static uint8_t isRunning = 0;
+static uint8_t hasRun = 0;
+
+static uint8_t sramData[SRAM_SIZE];
+
+static uint8_t eepromData[EEPROM_SIZE];
+static uint8_t isEepromWriteEnabled = 0;
+static uint8_t hasEepromWriteData = 0;
+static uint64_t eepromBusyEndTime = 0;
+
+static uint8_t displayMemory[DISPLAY_MEMORY_SIZE];
+static uint8_t displayAddress = 0;
+static uint8_t displayMode = 0;
+static uint8_t hasDisplayChanged = 1;
+
+static uint8_t drivenButtonMask = 0;
+static uint8_t pressedButtonMask = 0;
+static uint8_t buttonState = IDLE_BUTTON_STATE;
+static uint64_t buttonStateEndTime = 0;
+
+// Steps hold button masks, or WAIT_SCRIPT_STEP followed by milliseconds.
+static uint32_t scriptStepList[MAXIMUM_NUMBER_OF_SCRIPT_STEPS];
+static uint32_t numberOfScriptSteps = 0;
+static uint32_t scriptStepIndex = 0;
+
+static const char * const BUTTON_NAME_LIST[] = {"LEFT", "RIGHT", "UP", "DOWN", "RETURN", "ESCAPE"};
+
+static const char *outputPath = 0;
+static uint8_t isQuiet = 0;
+static uint8_t shouldPrintStatistics = 0;
+
+static void printDisplay(void)
+{
+	uint8_t tempRowAddress = 0;
+	printf("+----------------+\n");
+	while (1)
+	{
+		putchar('|');
+		uint8_t index = 0;
+		while (index < DISPLAY_WIDTH)
+		{
+			uint8_t tempCharacter = displayMemory[tempRowAddress + index];
+			if (tempCharacter < ' ' || tempCharacter > '~')
+			{
+				tempCharacter = '#';
+			}
+			putchar(tempCharacter);
+			index += 1;
+		}
+		printf("|\n");
+		if (tempRowAddress == DISPLAY_ROW_ADDRESS)
+		{
+			break;
+		}
+		tempRowAddress = DISPLAY_ROW_ADDRESS;
+	}
+	printf("+----------------+\n");
+	hasDisplayChanged = 0;
+}
+
+static void measureRun(void)
+{
+	runStatistics.busyTime = totalStatistics.busyTime - runStatistics.busyTime;
+	runStatistics.spiTransactionCount = totalStatistics.spiTransactionCount - runStatistics.spiTransactionCount;
+	runStatistics.spiTransferCount = totalStatistics.spiTransferCount - runStatistics.spiTransferCount;
+	runStatistics.heapSize = heapSize;
+	isRunning = 0;
+}
+
+// A run which is still going when the simulation ends is measured
+// up to that point.
+static void printStatistics(void)
+{
+	if (isRunning)
+	{
+		measureRun();
+	}
+	totalStatistics.heapSize = heapSize;
+	Statistics *tempStatistics = hasRun ? &runStatistics : &totalStatistics;
+	fprintf(stderr, "time %" PRIu64 " us, %" PRIu32 " SPI transactions, %" PRIu32 " SPI bytes, heap %d bytes\n", tempStatistics->busyTime, tempStatistics->spiTransactionCount, tempStatistics->spiTransferCount, tempStatistics->heapSize);
+}
+
+static void finishSimulation(int status)
+{
+	printDisplay();
+	if (status == 2)
+	{
+		printf("TIMEOUT\n");
+	}
+	if (outputPath)
+	{
+		FILE *tempFile = fopen(outputPath, "wb");
+		if (!tempFile || fwrite(eepromData, 1, EEPROM_SIZE, tempFile) != EEPROM_SIZE)
+		{
+			fprintf(stderr, "chipos-host: can not write %s\n", outputPath);
+			status = 1;
+		}
+		if (tempFile)
+		{
+			fclose(tempFile);
+		}
+	}
+	if (shouldPrintStatistics)
+	{
+		printStatistics();
+	}
+	fflush(stdout);
+	exit(status);
+}
+
+static void runTimerInterrupt(void)
+{
+	TIFR &= ~(1 << OCF0A);
+	uint8_t tempStatus = SREG;
+	SREG &= ~0x80;
+	TIMER0_COMPA_vect();
+	SREG = tempStatus;
+}
+
+static void updateButtons(void)
+{
+	if (buttonState == IDLE_BUTTON_STATE || currentTime < buttonStateEndTime)
+	{
+		return;
+	}
+	if (buttonState == HOLDING_BUTTON_STATE)
+	{
+		pressedButtonMask = 0;
+		buttonState = RELEASING_BUTTON_STATE;
+		buttonStateEndTime = currentTime + BUTTON_RELEASE_TIME;
+	} else {
+		buttonState = IDLE_BUTTON_STATE;
+	}
+}
+
+static void advanceTime(uint64_t amount)
+{
+	currentTime += amount;
+	totalStatistics.busyTime += amount;
+	while (currentTime >= nextTickTime)
+	{
+		nextTickTime += TIMER_TICK_TIME;
+		if (TIMSK & (1 << OCIE0A))
+		{
+			TIFR |= 1 << OCF0A;
+		}
+		if ((TIFR & (1 << OCF0A)) && (SREG & 0x80))
+		{
+			runTimerInterrupt();
+		}
+	}
+	updateButtons();
+	if (timeLimit && currentTime >= timeLimit)
+	{
+		finishSimulation(2);
+	}
+}
+
+// Starts the next step of the script when the previous one is done.
+static void runScript(void)
+{
+	if (buttonState != IDLE_BUTTON_STATE)
+	{
+		return;
+	}
+	if (scriptStepIndex >= numberOfScriptSteps)
+	{
+		finishSimulation(0);
+	}
+	if (hasDisplayChanged && !isQuiet)
+	{
+		printDisplay();
+	}
+	uint32_t tempStep = scriptStepList[scriptStepIndex];
+	scriptStepIndex += 1;
+	if (tempStep == WAIT_SCRIPT_STEP)
+	{
+		if (!isQuiet)
+		{
+			printf("WAIT %" PRIu32 "\n", scriptStepList[scriptStepIndex]);
+		}
+		buttonState = WAITING_BUTTON_STATE;
+		buttonStateEndTime = currentTime + scriptStepList[scriptStepIndex] * (uint64_t)1000;
+		scriptStepIndex += 1;
+	} else {
+		if (!isQuiet)
+		{
+			uint8_t index = 0;
+			while (!(tempStep & (0x80 >> index)))
+			{
+				index += 1;
+			}
+			printf("%s\n", BUTTON_NAME_LIST[index]);
+		}
+		pressedButtonMask = tempStep;
+		buttonState = HOLDING_BUTTON_STATE;
+		buttonStateEndTime = currentTime + BUTTON_HOLD_TIME;
+	}
+}
+
+void _delay_us(double microseconds)
+{
+	advanceTime((uint64_t)(microseconds + 0.5));
+}
+
+void _delay_ms(double milliseconds)
+{
+	advanceTime((uint64_t)(milliseconds * 1000 + 0.5));
+}
+
+void cli(void)
+{
+	SREG &= ~0x80;
+}
+
+void sei(void)
+{
+	SREG |= 0x80;
+	if (TIFR & (1 << OCF0A))
+	{
+		runTimerInterrupt();
+	}
+}
+
+void sleep_mode(void)
+{
+	runScript();
+	uint64_t tempBusyTime = totalStatistics.busyTime;
+	advanceTime(nextTickTime - currentTime);
+	totalStatistics.busyTime = tempBusyTime;
+}
+
+uint8_t hostReadTimerCounter(void)
+{
+	return (currentTime % TIMER_TICK_TIME) * (OCR0A + 1) / TIMER_TICK_TIME;
+}
+
+void hostSelectSpiDevice(uint8_t device)
+{
+	selectedSpiDevice = device;
+	spiByteIndex = 0;
+	totalStatistics.spiTransactionCount += 1;
+}
+
+void hostDeselectSpiDevice(uint8_t device)
+{
+	if (device == EEPROM_SPI_DEVICE && spiInstruction == 0x02 && hasEepromWriteData)
+	{
+		isEepromWriteEnabled = 0;
+		hasEepromWriteData = 0;
+		eepromBusyEndTime = currentTime + EEPROM_WRITE_TIME;
+	}
+	if (selectedSpiDevice == device)
+	{
+		selectedSpiDevice = 0;
+	}
+	spiInstruction = 0;
+}
+
+void hostSetDisplayMode(uint8_t mode)
+{
+	displayMode = mode;
+}
+
+// The SRAM is in sequential mode.
+static uint8_t transferSramByte(uint8_t value)
+{
+	uint8_t output = 0;
+	if (spiByteIndex == 0)
+	{
+		spiInstruction = value;
+		spiAddress = 0;
+	} else if (spiInstruction != 0x02 && spiInstruction != 0x03)
+	{
+		// Status register writes are ignored.
+	} else if (spiByteIndex < 3)
+	{
+		spiAddress = (spiAddress << 8) | value;
+	} else {
+		uint32_t tempAddress = spiAddress % SRAM_SIZE;
+		if (spiInstruction == 0x03)
+		{
+			output = sramData[tempAddress];
+		} else {
+			sramData[tempAddress] = value;
+		}
+		spiAddress += 1;
+	}
+	return output;
+}
+
+static uint8_t transferEepromByte(uint8_t value)
+{
+	uint8_t output = 0;
+	if (spiByteIndex == 0)
+	{
+		spiInstruction = value;
+		spiAddress = 0;
+		if (value == 0x06 && currentTime >= eepromBusyEndTime)
+		{
+			isEepromWriteEnabled = 1;
+		}
+		if (value == 0x04)
+		{
+			isEepromWriteEnabled = 0;
+		}
+	} else if (spiInstruction == 0x05)
+	{
+		output = (isEepromWriteEnabled << 1) | (currentTime < eepromBusyEndTime);
+	} else if (spiInstruction != 0x02 && spiInstruction != 0x03)
+	{
+		// Status register writes are ignored.
+	} else if (spiByteIndex < 4)
+	{
+		spiAddress = (spiAddress << 8) | value;
+	} else if (spiInstruction == 0x03)
+	{
+		output = eepromData[spiAddress % EEPROM_SIZE];
+		spiAddress += 1;
+	} else if (isEepromWriteEnabled && currentTime >= eepromBusyEndTime)
+	{
+		// Writes wrap around within the page.
+		eepromData[spiAddress % EEPROM_SIZE] = value;
+		spiAddress = (spiAddress & ~(EEPROM_PAGE_SIZE - 1)) | ((spiAddress + 1) & (EEPROM_PAGE_SIZE - 1));
+		hasEepromWriteData = 1;
+	}
+	return output;
+}
+
+static void transferDisplayByte(uint8_t value)
+{
+	if (displayMode)
+	{
+		displayMemory[displayAddress] = value;
+		displayAddress = (displayAddress + 1) % DISPLAY_MEMORY_SIZE;
+		hasDisplayChanged = 1;
+	} else if (value == 0x01)
+	{
+		memset(displayMemory, ' ', DISPLAY_MEMORY_SIZE);
+		displayAddress = 0;
+		hasDisplayChanged = 1;
+	} else if (value & 0x80)
+	{
+		displayAddress = value & 0x7F;
+	}
+}
+
+uint8_t hostTransferSpiByte(uint8_t value)
+{
+	uint8_t output = 0;
+	if (selectedSpiDevice == SRAM_SPI_DEVICE)
+	{
+		output = transferSramByte(value);
+	} else if (selectedSpiDevice == EEPROM_SPI_DEVICE)
+	{
+		output = transferEepromByte(value);
+	} else if (selectedSpiDevice == DISPLAY_SPI_DEVICE)
+	{
+		transferDisplayByte(value);
+	}
+	spiByteIndex += 1;
+	totalStatistics.spiTransferCount += 1;
+	advanceTime(SPI_BYTE_TIME);
+	return output;
+}
+
+void hostStartRun(void)
+{
+	runStatistics = totalStatistics;
+	isRunning = 1;
+	hasRun = 1;
+}
+
+void hostStopRun(void)
+{
+	measureRun();
+}
+
+void hostDriveButtonPin(uint8_t mask)
+{
+	drivenButtonMask |= mask;
+}
+
+void hostReleaseButtonPin(uint8_t mask)
+{
+	drivenButtonMask &= ~mask;
+}
+
+uint8_t hostReadButtonOutputPin(void)
+{
+	return !(drivenButtonMask & pressedButtonMask);
+}
+
+char *itoa(int value, char *text, int radix)
+{
+	if (value < 0)
+	{
+		text[0] = '-';
+		ultoa(-(uint32_t)value, text + 1, radix);
+	} else {
+		ultoa(value, text, radix);
+	}
+	return text;
+}
+
+char *ultoa(uint32_t value, char *text, int radix)
+{
+	char tempBuffer[33];
+	int index = 0;
+	do
+	{
+		uint32_t tempDigit = value % radix;
+		tempBuffer[index] = tempDigit < 10 ? '0' + tempDigit : 'a' + tempDigit - 10;
+		value /= radix;
+		index += 1;
+	} while (value);
+	int tempOffset = 0;
+	while (index > 0)
+	{
+		index -= 1;
+		text[tempOffset] = tempBuffer[index];
+		tempOffset += 1;
+	}
+	text[tempOffset] = 0;
+	return text;
+}
+
+static void addScriptStep(uint32_t step)
+{
+	if (numberOfScriptSteps >= MAXIMUM_NUMBER_OF_SCRIPT_STEPS)
+	{
+		fprintf(stderr, "chipos-host: script is too long\n");
+		exit(1);
+	}
+	scriptStepList[numberOfScriptSteps] = step;
+	numberOfScriptSteps += 1;
+}
+
+static uint8_t getButtonMask(const char *name, size_t length)
+{
+	uint8_t index = 0;
+	while (index < 6)
+	{
+		if (strlen(BUTTON_NAME_LIST[index]) == length && !strncmp(BUTTON_NAME_LIST[index], name, length))
+		{
+			return 0x80 >> index;
+		}
+		index += 1;
+	}
+	return 0;
+}
+
+static int loadScript(const char *path)
+{
+	FILE *tempFile = fopen(path, "r");
+	if (!tempFile)
+	{
+		fprintf(stderr, "chipos-host: can not read %s\n", path);
+		return 0;
+	}
+	char tempWord[64];
+	uint8_t isWaiting = 0;
+	while (fscanf(tempFile, "%63s", tempWord) == 1)
+	{
+		if (tempWord[0] == '#')
+		{
+			int tempCharacter;
+			do
+			{
+				tempCharacter = fgetc(tempFile);
+			} while (tempCharacter != '\n' && tempCharacter != EOF);
+			continue;
+		}
+		if (isWaiting)
+		{
+			addScriptStep(WAIT_SCRIPT_STEP);
+			addScriptStep(strtoul(tempWord, 0, 10));
+			isWaiting = 0;
+			continue;
+		}
+		if (!strcmp(tempWord, "WAIT"))
+		{
+			isWaiting = 1;
+			continue;
+		}
+		char *tempRepeat = strchr(tempWord, '*');
+		size_t tempLength = tempRepeat ? (size_t)(tempRepeat - tempWord) : strlen(tempWord);
+		uint8_t tempMask = getButtonMask(tempWord, tempLength);
+		if (!tempMask)
+		{
+			fprintf(stderr, "chipos-host: unknown script step %s\n", tempWord);
+			fclose(tempFile);
+			return 0;
+		}
+		uint32_t tempCount = tempRepeat ? strtoul(tempRepeat + 1, 0, 10) : 1;
+		while (tempCount > 0)
+		{
+			addScriptStep(tempMask);
+			tempCount -= 1;
+		}
+	}
+	fclose(tempFile);
+	return 1;
+}
+
+static int loadEeprom(const char *path)
+{
+	memset(eepromData, 0xFF, EEPROM_SIZE);
+	if (!strcmp(path, "-"))
+	{
+		return 1;
+	}
+	FILE *tempFile = fopen(path, "rb");
+	if (!tempFile)
+	{
+		fprintf(stderr, "chipos-host: can not read %s\n", path);
+		return 0;
+	}
+	fread(eepromData, 1, EEPROM_SIZE, tempFile);
+	fclose(tempFile);
+	return 1;
+}
+
+// Stores the program in the next empty file entry.
+static int storeFile(const char *path)
+{
+	const char *tempName = strrchr(path, '/');
+	tempName = tempName ? tempName + 1 : path;
+	size_t tempNameLength = strcspn(tempName, ".");
+	if (tempNameLength == 0 || tempNameLength > MAXIMUM_FILE_NAME_LENGTH)
+	{
+		fprintf(stderr, "chipos-host: bad file name %s\n", path);
+		return 0;
+	}
+	uint32_t tempAddress = 0;
+	while (eepromData[tempAddress] != 0xFF)
+	{
+		tempAddress += EEPROM_FILE_ENTRY_SIZE;
+		if (tempAddress >= EEPROM_SIZE)
+		{
+			fprintf(stderr, "chipos-host: no empty file entry for %s\n", path);
+			return 0;
+		}
+	}
+	FILE *tempFile = fopen(path, "rb");
+	if (!tempFile)
+	{
+		fprintf(stderr, "chipos-host: can not read %s\n", path);
+		return 0;
+	}
+	uint8_t *tempEntry = eepromData + tempAddress;
+	memset(tempEntry, 0, EEPROM_FILE_ENTRY_SIZE);
+	memcpy(tempEntry, tempName, tempNameLength);
+	// The program ends with a line break and a zero.
+	size_t tempMaximumLength = EEPROM_FILE_ENTRY_SIZE - EEPROM_FILE_DATA_OFFSET - 2;
+	uint8_t *tempData = tempEntry + EEPROM_FILE_DATA_OFFSET;
+	size_t tempLength = fread(tempData, 1, tempMaximumLength + 1, tempFile);
+	fclose(tempFile);
+	if (tempLength > tempMaximumLength)
+	{
+		fprintf(stderr, "chipos-host: %s is too long\n", path);
+		return 0;
+	}
+	if (tempLength > 0 && tempData[tempLength - 1] != '\n')
+	{
+		tempData[tempLength] = '\n';
+	}
+	return 1;
+}
+
+static void printUsage(void)
+{
+	fprintf(stderr, "usage: chipos-host [-f FILE]... [-o OUTPUT] [-t SECONDS] [-q] [-s] EEPROM SCRIPT\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *tempEepromPath = 0;
+	const char *tempScriptPath = 0;
+	const char *tempFilePathList[argc];
+	int tempNumberOfFiles = 0;
+	int index = 1;
+	while (index < argc)
+	{
+		const char *tempArgument = argv[index];
+		if (!strcmp(tempArgument, "-f") && index + 1 < argc)
+		{
+			index += 1;
+			tempFilePathList[tempNumberOfFiles] = argv[index];
+			tempNumberOfFiles += 1;
+		} else if (!strcmp(tempArgument, "-o") && index + 1 < argc)
+		{
+			index += 1;
+			outputPath = argv[index];
+		} else if (!strcmp(tempArgument, "-t") && index + 1 < argc)
+		{
+			index += 1;
+			timeLimit = (uint64_t)(atof(argv[index]) * 1000000);
+		} else if (!strcmp(tempArgument, "-q"))
+		{
+			isQuiet = 1;
+		} else if (!strcmp(tempArgument, "-s"))
+		{
+			shouldPrintStatistics = 1;
+		} else if (!tempEepromPath)
+		{
+			tempEepromPath = tempArgument;
+		} else if (!tempScriptPath)
+		{
+			tempScriptPath = tempArgument;
+		} else {
+			printUsage();
+			return 1;
+		}
+		index += 1;
+	}
+	if (!tempEepromPath || !tempScriptPath)
+	{
+		printUsage();
+		return 1;
+	}
+	if (!loadEeprom(tempEepromPath) || !loadScript(tempScriptPath))
+	{
+		return 1;
+	}
+	index = 0;
+	while (index < tempNumberOfFiles)
+	{
+		if (!storeFile(tempFilePathList[index]))
+		{
+			return 1;
+		}
+		index += 1;
+	}
+	memset(displayMemory, ' ', DISPLAY_MEMORY_SIZE);
+	return chiposMain();
+}
@@ -0,0 +1,111 @@
+
+// Replaces the AVR headers when main.c is built for the host with
+// HOST_BUILD set. The pins, the SPI bus, the timer and the delays are
+// routed to the device models in host.c, which run on virtual time.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const unsigned char *)(address))
+#define pgm_read_word(address) (*(address))
+
+#define ISR(vector) void vector(void)
+void TIMER0_COMPA_vect(void);
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t TIMSK;
+extern volatile uint8_t TIFR;
+#define TCNT0L hostReadTimerCounter()
+#define CTC0 0
+#define CS00 0
+#define CS01 1
+#define OCIE0A 4
+#define OCF0A 4
+
+#define SRAM_SPI_DEVICE 1
+#define EEPROM_SPI_DEVICE 2
+#define DISPLAY_SPI_DEVICE 3
+
+#define MISO_PIN_INPUT
+#define MOSI_PIN_OUTPUT
+#define SCK_PIN_OUTPUT
+#define SCK_PIN_HIGH
+#define SCK_PIN_LOW
+
+#define SRAM_CS_PIN_OUTPUT
+#define SRAM_CS_PIN_HIGH   hostDeselectSpiDevice(SRAM_SPI_DEVICE)
+#define SRAM_CS_PIN_LOW   hostSelectSpiDevice(SRAM_SPI_DEVICE)
+
+#define EEPROM_CS_PIN_OUTPUT
+#define EEPROM_CS_PIN_HIGH   hostDeselectSpiDevice(EEPROM_SPI_DEVICE)
+#define EEPROM_CS_PIN_LOW   hostSelectSpiDevice(EEPROM_SPI_DEVICE)
+
+#define DISPLAY_CS_PIN_OUTPUT
+#define DISPLAY_CS_PIN_HIGH   hostDeselectSpiDevice(DISPLAY_SPI_DEVICE)
+#define DISPLAY_CS_PIN_LOW   hostSelectSpiDevice(DISPLAY_SPI_DEVICE)
+
+#define DISPLAY_MODE_PIN_OUTPUT
+#define DISPLAY_MODE_PIN_HIGH   hostSetDisplayMode(1)
+#define DISPLAY_MODE_PIN_LOW   hostSetDisplayMode(0)
+
+#define DISPLAY_RESET_PIN_OUTPUT
+#define DISPLAY_RESET_PIN_HIGH
+#define DISPLAY_RESET_PIN_LOW
+
+// A button pin which is an output pulls the button output pin low
+// while the button is pressed.
+#define LEFT_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x80)
+#define LEFT_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x80)
+#define LEFT_BUTTON_PIN_LOW
+
+#define RIGHT_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x40)
+#define RIGHT_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x40)
+#define RIGHT_BUTTON_PIN_LOW
+
+#define UP_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x20)
+#define UP_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x20)
+#define UP_BUTTON_PIN_LOW
+
+#define DOWN_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x10)
+#define DOWN_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x10)
+#define DOWN_BUTTON_PIN_LOW
+
+#define RETURN_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x08)
+#define RETURN_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x08)
+#define RETURN_BUTTON_PIN_LOW
+
+#define ESCAPE_BUTTON_PIN_OUTPUT   hostDriveButtonPin(0x04)
+#define ESCAPE_BUTTON_PIN_INPUT   hostReleaseButtonPin(0x04)
+#define ESCAPE_BUTTON_PIN_LOW
+
+#define BUTTON_OUTPUT_PIN_INPUT
+#define BUTTON_OUTPUT_PIN_READ   hostReadButtonOutputPin()
+
+void hostSelectSpiDevice(uint8_t device);
+void hostDeselectSpiDevice(uint8_t device);
+uint8_t hostTransferSpiByte(uint8_t value);
+void hostSetDisplayMode(uint8_t mode);
+void hostDriveButtonPin(uint8_t mask);
+void hostReleaseButtonPin(uint8_t mask);
+uint8_t hostReadButtonOutputPin(void);
+uint8_t hostReadTimerCounter(void);
+// Mark the start and the end of a program run for the statistics.
+void hostStartRun(void);
+void hostStopRun(void);
+
+void _delay_us(double microseconds);
+void _delay_ms(double milliseconds);
+void cli(void);
+void sei(void);
+// Lets virtual time pass until the next timer tick.
+void sleep_mode(void);
+
+char *itoa(int value, char *text, int radix);
+char *ultoa(uint32_t value, char *text, int radix);
+
+int chiposMain(void);
+extern short heapSize;
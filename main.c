@@ -1,19 +1,185 @@
 
+// Set to 1 by the host Makefile target, which runs the interpreter
+// against the device models in host.c.
+#ifndef HOST_BUILD
+#define HOST_BUILD 0
+#endif
+
+#if HOST_BUILD
+#include "host.h"
+#else
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <stdint.h>
 #include <stdlib.h>
+#endif
 
 #define byte unsigned char
 #define true 1
 #define false 0
 
+// The flags below can be overridden with -D, for example through
+// FEATURES in the Makefile.
+
+// Set to 1 to clock SPI with the USI instead of bit-banging it.
+// The USI shifts out on DO (PB1) and in on DI (PB0), which is the opposite
+// of the bit-banged wiring, so MOSI and MISO must be routed to match.
+#ifndef SPI_USE_USI
+#define SPI_USE_USI 0
+#endif
+
+// Set to 1 to unroll the bit loops of the bit-banged bus, which makes it
+// about a third faster. Off by default, because the firmware has no flash
+// left for it.
+#ifndef ENABLE_UNROLLED_SPI
+#define ENABLE_UNROLLED_SPI 0
+#endif
+
+// Set to 1 to store text as packed strings of characters instead of
+// lists. Off by default, because the firmware has no flash left for them.
+// Programs behave the same either way.
+#ifndef ENABLE_PACKED_STRINGS
+#define ENABLE_PACKED_STRINGS 0
+#endif
+
+// Set to 1 to store arrays in consecutive heap entries. Without them,
+// ARR stops the program with an error. Off by default, because the
+// firmware has no flash left for them.
+#ifndef ENABLE_ARRAYS
+#define ENABLE_ARRAYS 0
+#endif
+
+// Set to 1 to keep literals in a table of constants, so that a command
+// only builds them the first time it runs. Off by default, because the
+// firmware has no flash left for it.
+#ifndef ENABLE_CONSTANT_TABLE
+#define ENABLE_CONSTANT_TABLE 0
+#endif
+
+// Set to 1 to add the FILL, COPY, SUM, FIND and REV built-in functions.
+// Off by default, because the firmware has no flash left for them.
+// Without them, programs which use them stop with UNKNOWN FUNCTION.
+#ifndef ENABLE_BULK_LIST_FUNCTIONS
+#define ENABLE_BULK_LIST_FUNCTIONS 0
+#endif
+
+// Set to 1 to poll the EEPROM status after page writes instead of waiting
+// for the longest write time, and to measure how long the writes take.
+// Off by default, because the firmware has no flash left for it.
+#ifndef ENABLE_EEPROM_STATUS_POLLING
+#define ENABLE_EEPROM_STATUS_POLLING 0
+#endif
+
+// Set to 1 to keep a copy of the display contents in RAM, so that only
+// the characters which change are sent. Off by default, because the
+// firmware has no flash or RAM left for it.
+#ifndef ENABLE_DISPLAY_FRAMEBUFFER
+#define ENABLE_DISPLAY_FRAMEBUFFER 0
+#endif
+
+// Set to 1 to scan the buttons in the timer interrupt and queue their
+// presses and releases. Without it, the buttons are polled, which takes
+// 6 ms for each read. Off by default, because the firmware has no flash
+// left for it.
+#ifndef ENABLE_KEYPAD_INTERRUPT
+#define ENABLE_KEYPAD_INTERRUPT 0
+#endif
+
+// Set to 1 to look up called files in a hashed table of their names in
+// SRAM. Without it, each call reads the file names from the EEPROM until
+// it finds the file. Off by default, because the firmware has no flash
+// left for it.
+#ifndef ENABLE_FILE_NAME_TABLE
+#define ENABLE_FILE_NAME_TABLE 0
+#endif
+
+// Set to 1 to remember where skipped blocks end, so that IF, WHL, BRK
+// and FOR jump past them after the first time. Without it, every skipped
+// block is read through to its END. Off by default, because the firmware
+// has no flash left for it.
+#ifndef ENABLE_BLOCK_TABLE
+#define ENABLE_BLOCK_TABLE 0
+#endif
+
+// Set to 1 to keep the variables of the current scope in internal RAM,
+// together with a mask of the ones which were assigned. Without it, the
+// variables are read and written in the scope. Off by default, because
+// the firmware has no flash or RAM left for it.
+#ifndef ENABLE_SCOPE_VARIABLE_CACHE
+#define ENABLE_SCOPE_VARIABLE_CACHE 0
+#endif
+
+// Set to 1 to allow nested expressions such as [* A B] as arguments.
+// Without them, programs which use them stop with BAD EXPRESSION. Off by
+// default, because the firmware has no flash left for them.
+#ifndef ENABLE_NESTED_EXPRESSIONS
+#define ENABLE_NESTED_EXPRESSIONS 0
+#endif
+
+// Set to 1 to add the FOR loop. Without it, programs which use FOR stop
+// with UNKNOWN FUNCTION. Off by default, because the firmware has no
+// flash left for it.
+#ifndef ENABLE_FOR_LOOPS
+#define ENABLE_FOR_LOOPS 0
+#endif
+
+// Set to 1 to chain dead heap entries into a free list, so that an entry
+// is allocated in constant time. Without it, allocation searches the heap
+// for a dead entry. Off by default, because the firmware has no flash
+// left for it.
+#ifndef ENABLE_HEAP_FREE_LIST
+#define ENABLE_HEAP_FREE_LIST 0
+#endif
+#if ENABLE_ARRAYS && !ENABLE_HEAP_FREE_LIST
+// A search would mistake array elements for dead entries.
+#error "ENABLE_ARRAYS needs ENABLE_HEAP_FREE_LIST"
+#endif
+
+// Set to 1 to keep small integers in their pointers instead of allocating
+// heap entries for them. Without it, every integer is a heap entry.
+// Off by default, because the firmware has no flash left for it.
+#ifndef ENABLE_TAGGED_INTEGERS
+#define ENABLE_TAGGED_INTEGERS 0
+#endif
+
+// Set to 1 to count the time and the SPI transactions which each built-in
+// function takes while a program runs. The file menu then shows a report.
+#ifndef ENABLE_PROFILER
+#define ENABLE_PROFILER 0
+#endif
+
+// Set to 1 to count the SPI transactions, bytes and bus time of the SRAM,
+// the EEPROM and the display, and the hits and misses of the SRAM cache.
+// Escape in the main menu shows the counts.
+#ifndef ENABLE_BUS_COUNTERS
+#define ENABLE_BUS_COUNTERS 0
+#endif
+
+// Timer 0 only runs when one of the features above needs it.
+#define USE_TIMER (ENABLE_KEYPAD_INTERRUPT || ENABLE_EEPROM_STATUS_POLLING || ENABLE_PROFILER)
+
+#if HOST_BUILD
+// host.h defines the pins.
+#elif SPI_USE_USI
+#define MISO_PIN_INPUT   DDRB &= ~(1 << DDB0)
+#define MISO_PIN_READ   (PINB & (1 << PINB0))
+
+#define MOSI_PIN_OUTPUT   DDRB |= (1 << DDB1)
+#define MOSI_PIN_HIGH   PORTB |= (1 << PORTB1)
+#define MOSI_PIN_LOW   PORTB &= ~(1 << PORTB1)
+#else
 #define MISO_PIN_INPUT   DDRB &= ~(1 << DDB1)
 #define MISO_PIN_READ   (PINB & (1 << PINB1))
 
 #define MOSI_PIN_OUTPUT   DDRB |= (1 << DDB0)
 #define MOSI_PIN_HIGH   PORTB |= (1 << PORTB0)
 #define MOSI_PIN_LOW   PORTB &= ~(1 << PORTB0)
+#endif
+
+#if !HOST_BUILD
 
 #define SCK_PIN_OUTPUT   DDRB |= (1 << DDB2)
 #define SCK_PIN_HIGH   PORTB |= (1 << PORTB2)
@@ -65,10 +231,39 @@
 
 #define BUTTON_OUTPUT_PIN_INPUT   DDRA &= ~(1 << DDA3)
 #define BUTTON_OUTPUT_PIN_READ   (PINA & (1 << PINA3))
+#endif
 
-#define SPI_DELAY 5
+// Estimated time in microseconds to shift one byte. The bit-banged bus
+// takes about 8 cycles per bit at 8 MHz when it is unrolled, and about 12
+// in a loop. host.c uses the same time.
+#if SPI_USE_USI
+#define SPI_BYTE_TIME 4
+#elif ENABLE_UNROLLED_SPI
+#define SPI_BYTE_TIME 8
+#else
+#define SPI_BYTE_TIME 12
+#endif
+#define SRAM_COPY_BUFFER_SIZE 32
+// Number of lines in the SRAM cache. Must be a power of two no greater
+// than 8, or 0 to disable the cache. Each line takes 10 bytes of RAM.
+// Off by default, because the firmware has no flash left for the cache.
+#ifndef SRAM_CACHE_LINE_COUNT
+#define SRAM_CACHE_LINE_COUNT 0
+#endif
+#define SRAM_CACHE_LINE_SIZE 8
+// Size of the window of program text which the program reader keeps in
+// RAM, or 0 to read the program one byte at a time. Off by default, because
+// the firmware can not spare the RAM.
+#ifndef PROGRAM_READER_BUFFER_SIZE
+#define PROGRAM_READER_BUFFER_SIZE 0
+#endif
 
 #define DISPLAY_WIDTH 16
+#define DISPLAY_SIZE (DISPLAY_WIDTH * 2)
+#define DISPLAY_COMMAND_DELAY 30
+#define DISPLAY_CHARACTER_DELAY 50
+#define DISPLAY_RESET_DELAY 50
+#define DISPLAY_CLEAR_DELAY 2
 
 #define LEFT_BUTTON_MASK 0x80
 #define RIGHT_BUTTON_MASK 0x40
@@ -77,12 +272,30 @@
 #define RETURN_BUTTON_MASK 0x08
 #define ESCAPE_BUTTON_MASK 0x04
 
+#define NUMBER_OF_BUTTONS 6
+#define BUTTON_DEBOUNCE_SCANS 2
+#define BUTTON_RELEASE_POLL_DELAY 50
+#define BUTTON_EVENT_QUEUE_SIZE 8
+#define BUTTON_RELEASE_EVENT_FLAG 0x01
+
+// Timer 0 ticks once per millisecond.
+#define TIMER_PRESCALER 64
+#define TIMER_COMPARE_VALUE (F_CPU / TIMER_PRESCALER / 1000 - 1)
+// Microseconds per timer count.
+#define TIMER_COUNT_TIME (TIMER_PRESCALER / (F_CPU / 1000000))
+
 #define MAXIMUM_FILE_NAME_LENGTH 16
 #define FILE_DATA_OFFSET MAXIMUM_FILE_NAME_LENGTH + 1
 #define FILE_ENTRY_SIZE 4096
 #define NUMBER_OF_FILE_ENTRY_POSITIONS 32
 #define EMPTY_FILE_ENTRY_INDICATOR 0xFF
 #define FILE_BUFFER_SIZE 100
+#define EEPROM_WRITE_POLL_DELAY 50
+#define EEPROM_WRITE_TIMEOUT 20000
+// The status read sends the command and receives the status.
+#define EEPROM_STATUS_READ_TIME (2 * SPI_BYTE_TIME)
+// Milliseconds to wait after a page write when the status is not polled.
+#define EEPROM_WRITE_DELAY 10
 
 #define SPECIAL_CHARACTER_LENGTH 6
 #define NUMBER_OF_SPECIAL_CHARACTERS 2
@@ -97,12 +310,80 @@
 #define SCOPE_RETURN_ADDRESS_OFFSET 0
 #define SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET 4
 #define SCOPE_SIZE_OFFSET 6
-#define SCOPE_VARIABLE_LIST_OFFSET 8
+#define SCOPE_HEADER_SIZE 8
+// Bit n of the mask is set when variable n holds a reference.
+// Variables whose bit is clear are 0, whatever the scope holds.
+// The mask is only kept with ENABLE_SCOPE_VARIABLE_CACHE.
+#define SCOPE_VARIABLE_MASK_OFFSET 8
+#define SCOPE_VARIABLE_LIST_OFFSET 12
 #define NUMBER_OF_SCOPE_VARIABLES 26
 #define SCOPE_FLOW_DATA_OFFSET SCOPE_VARIABLE_LIST_OFFSET + NUMBER_OF_SCOPE_VARIABLES * 2
 
-#define HEAP_START_ADDRESS 32000
+// Maps file names to file indexes while a program runs.
+// The table is hashed and is never more than half full.
+#define FILE_NAME_TABLE_ADDRESS 31616
+#define FILE_NAME_TABLE_SIZE 64
+#define FILE_NAME_TABLE_ENTRY_SIZE (MAXIMUM_FILE_NAME_LENGTH + 2)
+#define FILE_NAME_TABLE_INDEX_OFFSET (MAXIMUM_FILE_NAME_LENGTH + 1)
+#define EMPTY_FILE_NAME_TABLE_ENTRY 255
+
+// Remembers where each skipped block ends while a program runs.
+// Blocks are keyed by the address of the IF, WHL or BRK which skips them.
+#define BLOCK_TABLE_ADDRESS 31104
+#define BLOCK_TABLE_SIZE 64
+#define BLOCK_TABLE_ENTRY_SIZE 8
+#define EMPTY_BLOCK_TABLE_ENTRY -1
+// The table is never filled past this many entries, so that a search
+// for a block which is not in the table ends at an empty slot.
+#define MAXIMUM_BLOCK_TABLE_ENTRY_COUNT (BLOCK_TABLE_SIZE * 3 / 4)
+
+// Maps the address of each literal to its constant while a program runs.
+// Literals which do not fit in the table are allocated every time they run.
+#define CONSTANT_TABLE_ADDRESS 30592
+#define CONSTANT_TABLE_SIZE 64
+#define CONSTANT_TABLE_ENTRY_SIZE 8
+#define CONSTANT_TABLE_POINTER_OFFSET 4
+#define CONSTANT_TABLE_LENGTH_OFFSET 6
+#define EMPTY_CONSTANT_TABLE_ENTRY -1
+
+#if ENABLE_BULK_LIST_FUNCTIONS
+#define NUMBER_OF_BUILT_IN_FUNCTIONS 35
+#else
+#define NUMBER_OF_BUILT_IN_FUNCTIONS 30
+#endif
+// IF, END, WHL, BRK and RET.
+#define FIRST_FLOW_CONTROL_FUNCTION 14
+#define LAST_FLOW_CONTROL_FUNCTION 18
+
+#if ENABLE_PROFILER
+// Holds one entry for every built-in function, followed by the entries
+// of custom function calls and of commands which were skipped.
+// Each entry holds the number of runs, the time in timer counts,
+// and the number of SRAM and EEPROM transactions.
+#define PROFILE_TABLE_ADDRESS (CONSTANT_TABLE_ADDRESS - NUMBER_OF_PROFILE_ENTRIES * PROFILE_ENTRY_SIZE)
+#define NUMBER_OF_PROFILE_ENTRIES (NUMBER_OF_BUILT_IN_FUNCTIONS + 2)
+#define CUSTOM_FUNCTION_PROFILE_INDEX NUMBER_OF_BUILT_IN_FUNCTIONS
+#define SKIPPED_COMMAND_PROFILE_INDEX (NUMBER_OF_BUILT_IN_FUNCTIONS + 1)
+#define PROFILE_ENTRY_SIZE 16
+#define PROFILE_COUNT_OFFSET 0
+#define PROFILE_TIME_OFFSET 4
+#define PROFILE_SRAM_TRANSACTION_COUNT_OFFSET 8
+#define PROFILE_EEPROM_TRANSACTION_COUNT_OFFSET 12
+// Lowest address used by the tables which are kept while a program runs.
+#define RUN_TABLE_START_ADDRESS PROFILE_TABLE_ADDRESS
+#else
+#define RUN_TABLE_START_ADDRESS CONSTANT_TABLE_ADDRESS
+#endif
+
+#if ENABLE_BUS_COUNTERS
+#define SRAM_BUS_INDEX 0
+#define EEPROM_BUS_INDEX 1
+#define DISPLAY_BUS_INDEX 2
+#define NUMBER_OF_BUSES 3
+#endif
+
 #define HEAP_ENTRY_SIZE 8
+#define HEAP_START_ADDRESS (RUN_TABLE_START_ADDRESS - HEAP_ENTRY_SIZE)
 #define HEAP_ENTRY_TYPE_OFFSET 0
 #define HEAP_ENTRY_REFERENCE_COUNT_OFFSET 2
 #define HEAP_ENTRY_DATA_OFFSET 4
@@ -111,15 +392,52 @@
 #define EMPTY_HEAP_ENTRY_TYPE 0
 #define INTEGER_HEAP_ENTRY_TYPE 1
 #define LIST_HEAP_ENTRY_TYPE 2
+// Strings are lists of characters packed into chunks. The first entry
+// holds the number of characters, including the null terminator, and links
+// to the first chunk. Chunks hold the characters and a link to the next chunk.
+#define STRING_HEAP_ENTRY_TYPE 3
+#define STRING_CHUNK_SIZE 6
+// Arrays keep their element references in a block of consecutive heap
+// entries. The first entry holds the number of elements and links to the
+// block. The block starts with its capacity, followed by the elements.
+#define ARRAY_HEAP_ENTRY_TYPE 4
+#define ARRAY_CAPACITY_OFFSET 0
+#define ARRAY_ELEMENT_LIST_OFFSET 2
+// Released blocks stay together, so that a later block can reuse them.
+// A free block holds its number of entries and links to the next free block.
+#define FREE_HEAP_BLOCK_SIZE_OFFSET 0
+
+// Heap entry addresses are always even. Odd pointers hold small
+// integers directly, shifted left by one.
+#define TAGGED_INTEGER_FLAG 1
+#define MINIMUM_TAGGED_INTEGER -16384
+#define MAXIMUM_TAGGED_INTEGER 16383
+
+// Every heap entry of a constant has this reference count, which is never
+// changed. Constants are copied before they are stored or changed.
+#define CONSTANT_REFERENCE_COUNT 0x4000
 
 #define INTERPRET_FLOW_DATA -1
 #define IGNORE_FLOW_DATA -2
+// Left by BRK in place of a FOR loop. Like INTERPRET_FLOW_DATA, but END
+// also drops the bound and step of the loop.
+#define INTERPRET_FOR_FLOW_DATA -3
+// A FOR loop takes two flow data entries. The lower one holds the bound
+// in its low half and the step in its high half. The upper one holds
+// this flag, the index of the counter variable, and the address of
+// the first command in the loop.
+#define FOR_FLOW_DATA_FLAG 0x40000000
+#define FOR_FLOW_DATA_VARIABLE_SHIFT 24
+#define FOR_FLOW_DATA_ADDRESS_MASK 0x00FFFFFF
+
+#define COMMAND_NAME_BUFFER_SIZE 30
+#define MAXIMUM_NUMBER_OF_ARGUMENTS 10
 
 const short RANDOM_DATA_LIST_1[] PROGMEM = {26300, 12613, 26904, 8022, 30794, 31703, 25650, 2068, 26336, 26781, 16264, 19980, 15295, 31750, 3123, 32465, 4086, 14700, 31978};
 const short RANDOM_DATA_LIST_2[] PROGMEM = {29646, 3873, 6645, 27385, 11518, 9321, 2002, 31546, 5100, 12871, 15150, 10975, 23235, 16316, 10161, 745, 27271, 26236, 7635, 9953, 15108, 30539, 16157, 16197, 20820, 21735, 24581, 14531, 21504, 21949, 27284};
 
 const byte DISPLAY_INITIALIZATION_COMMANDS[] PROGMEM = {0x39, 0x14, 0x55, 0x6D, 0x7F, 0x38, 0x0C, 0x01, 0x06};
-const byte CHARACTER_SET[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789,.?!;:'\"()=<>+-*/%\x9C|&";
+const byte CHARACTER_SET[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789,.?!;:'\"()=<>+-*/%\x9C|&[]";
 const byte SPECIAL_CHARACTER_SET[] PROGMEM = "SPACE DELETE";
 
 const byte MESSAGE_1[] PROGMEM = "SAVED";
@@ -131,6 +449,15 @@ const byte MESSAGE_6[] PROGMEM = "RENAMED";
 const byte MESSAGE_7[] PROGMEM = "CHIPOS V1";
 const byte MESSAGE_8[] PROGMEM = "NO FILES";
 //const byte MESSAGE_9[] PROGMEM = "GO AWAY!";
+const byte MESSAGE_10[] PROGMEM = "BAD EXPRESSION";
+#if ENABLE_FOR_LOOPS
+const byte MESSAGE_11[] PROGMEM = "BAD FOR";
+#endif
+#if ENABLE_EEPROM_STATUS_POLLING
+const byte MESSAGE_12[] PROGMEM = "EEPROM TIMEOUT";
+#endif
+const byte MESSAGE_13[] PROGMEM = "TOO MANY ARGS";
+const byte MESSAGE_14[] PROGMEM = "UNKNOWN FUNCTION";
 const byte SELECTION_ITEM_1[] PROGMEM = "INSERT";
 const byte SELECTION_ITEM_2[] PROGMEM = "DELETE";
 const byte SELECTION_ITEM_3[] PROGMEM = "EDIT";
@@ -147,22 +474,156 @@ const byte SELECTION_ITEM_13[] PROGMEM = "YES DELETE";
 const byte * const SELECTION_MENU_1[] PROGMEM = {SELECTION_ITEM_1, SELECTION_ITEM_2, SELECTION_ITEM_3};
 const byte * const SELECTION_MENU_2[] PROGMEM = {SELECTION_ITEM_4, SELECTION_ITEM_5};
 const byte * const SELECTION_MENU_3[] PROGMEM = {SELECTION_ITEM_6, SELECTION_ITEM_7};
+#if ENABLE_PROFILER
+const byte SELECTION_ITEM_14[] PROGMEM = "PROFILE";
+const byte * const SELECTION_MENU_4[] PROGMEM = {SELECTION_ITEM_8, SELECTION_ITEM_9, SELECTION_ITEM_14, SELECTION_ITEM_10, SELECTION_ITEM_11};
+const byte PROFILE_NAME_1[] PROGMEM = "CALL";
+const byte PROFILE_NAME_2[] PROGMEM = "SKIP";
+#else
 const byte * const SELECTION_MENU_4[] PROGMEM = {SELECTION_ITEM_8, SELECTION_ITEM_9, SELECTION_ITEM_10, SELECTION_ITEM_11};
+#endif
 const byte * const SELECTION_MENU_5[] PROGMEM = {SELECTION_ITEM_12, SELECTION_ITEM_13};
 
-const byte BUILT_IN_FUNCTION_NAME_LIST[] PROGMEM = "= + - * / % == > ! \x9C | & << >> IF END WHL BRK RET RAND STR INT LEN TRUNC GET SET PRINT INPUT ";
+#if ENABLE_BUS_COUNTERS
+#define BUS_NAME_SIZE 8
+const byte BUS_NAME_LIST[] PROGMEM = "SRAM\0\0\0\0EEPROM\0\0DISPLAY";
+#endif
+
+const byte BUILT_IN_FUNCTION_NAME_LIST[] PROGMEM = "= + - * / % == > ! \x9C | & << >> IF END WHL BRK RET RAND STR INT LEN TRUNC GET SET PRINT INPUT ARR FOR "
+#if ENABLE_BULK_LIST_FUNCTIONS
+	"FILL COPY SUM FIND REV "
+#endif
+	;
+#if ENABLE_NESTED_EXPRESSIONS
+// TRUNC, SET, PRINT, FOR, FILL and REV change their first argument or have
+// no result, so they can not be nested.
+const byte NO_RESULT_FUNCTION_LIST[] PROGMEM = {23, 25, 26, 29, 30, 34};
+#endif
 
 short randomNumber = 0;
 byte randomNumberState1 = 0;
 byte randomNumberState2 = 0;
 
-long commandAddress;
+int32_t commandAddress;
+int32_t programReaderAddress;
+#if PROGRAM_READER_BUFFER_SIZE
+int32_t programReaderBufferAddress = -PROGRAM_READER_BUFFER_SIZE;
+byte programReaderBuffer[PROGRAM_READER_BUFFER_SIZE];
+#endif
+#if ENABLE_EEPROM_STATUS_POLLING
+// Measured busy time of EEPROM page writes in microseconds.
+unsigned short lastEepromPageWriteTime = 0;
+unsigned short maximumEepromPageWriteTime = 0;
+#endif
 short scopeAddress;
+#if ENABLE_SCOPE_VARIABLE_CACHE
+// The variables of the current scope are kept here instead of in the scope.
+// They are written back to the scope before a function is called.
+short scopeVariableList[NUMBER_OF_SCOPE_VARIABLES];
+uint32_t scopeVariableMask;
+#endif
 short heapSize = 0;
+#if ENABLE_HEAP_FREE_LIST
+// Dead heap entries are chained through their link fields.
+short freeHeapEntryAddress = 0;
+#endif
+#if ENABLE_ARRAYS
+short freeHeapBlockAddress = 0;
+#endif
 byte isIgnoringCommands;
-short argumentPointerAddressList[10];
+#if ENABLE_BLOCK_TABLE
+// The command which started ignoring commands, or -1 if the block end
+// should not be remembered.
+int32_t ignoredBlockAddress;
+byte blockTableEntryCount;
+#endif
+short argumentPointerAddressBuffer[MAXIMUM_NUMBER_OF_ARGUMENTS];
+#if ENABLE_NESTED_EXPRESSIONS
+// Arguments of the command which runs. A nested expression moves this
+// up to its own arguments while it runs.
+short *argumentPointerAddressList = argumentPointerAddressBuffer;
+#else
+#define argumentPointerAddressList argumentPointerAddressBuffer
+#endif
+#if ENABLE_CONSTANT_TABLE
+// Set when a literal refers to a variable or holds a nested expression,
+// so that it is not kept as a constant.
+byte hasNonConstantTerm;
+#endif
 byte hasStoppedExecution;
 
+#if USE_TIMER
+volatile unsigned short timerTickCount = 0;
+#endif
+#if ENABLE_KEYPAD_INTERRUPT
+// Debounced state of the buttons, maintained by the timer interrupt.
+volatile byte buttonState = 0;
+byte buttonScanIndex = 0;
+byte buttonScanState = 0;
+byte lastButtonScanState = 0;
+byte buttonStableScanCount = 0;
+// Press events hold the masks of the pressed buttons. Release events
+// also have BUTTON_RELEASE_EVENT_FLAG set.
+volatile byte buttonEventQueue[BUTTON_EVENT_QUEUE_SIZE];
+volatile byte buttonEventQueueStart = 0;
+volatile byte buttonEventQueueEnd = 0;
+#endif
+
+#if ENABLE_DISPLAY_FRAMEBUFFER
+// Shadow of the display contents. Cells are drawn into displayFrame
+// and only the dirty ones are sent by flushDisplay.
+byte displayFrame[DISPLAY_SIZE];
+uint32_t displayDirtyMask = 0;
+#endif
+// Cell index which the display address counter points to, or 255 if unknown.
+byte displayCursorIndex = 255;
+
+#if SRAM_CACHE_LINE_COUNT
+#if SRAM_CACHE_LINE_COUNT > 8
+#error "SRAM_CACHE_LINE_COUNT must be at most 8"
+#endif
+// Direct-mapped write-back cache of aligned SRAM lines. Accesses which fit
+// in one line go through the cache. Sessions write the dirty lines back
+// before they start, and write sessions drop the lines which they overwrite.
+byte sramCacheLineList[SRAM_CACHE_LINE_COUNT][SRAM_CACHE_LINE_SIZE];
+short sramCacheLineAddressList[SRAM_CACHE_LINE_COUNT];
+byte sramCacheValidMask = 0;
+byte sramCacheDirtyMask = 0;
+#if ENABLE_BUS_COUNTERS
+// Cache lookups since the last run. A miss loads or replaces a line.
+uint32_t sramCacheHitCount;
+uint32_t sramCacheMissCount;
+#endif
+// Range of addresses written by the current write session.
+short sramWriteSessionStartAddress;
+short sramWriteSessionEndAddress;
+#endif
+
+#if ENABLE_PROFILER
+unsigned short sramTransactionCount = 0;
+unsigned short eepromTransactionCount = 0;
+// Profile entry of the command which is running.
+byte profileIndex;
+// Totals of one profile entry, which are kept in RAM until a command
+// with another entry runs.
+byte profileEntryIndex;
+byte profileEntry[PROFILE_ENTRY_SIZE];
+uint32_t profileStartTime;
+uint32_t profilePauseStartTime;
+// Time the command spent waiting for the user.
+uint32_t profilePausedTime;
+unsigned short profileStartSramTransactionCount;
+unsigned short profileStartEepromTransactionCount;
+#endif
+
+#if ENABLE_BUS_COUNTERS
+// Counts for each device since the last run. The wait time is spent
+// in delays which the device needs, and is part of the bus time.
+uint32_t busTransactionCountList[NUMBER_OF_BUSES];
+uint32_t busByteCountList[NUMBER_OF_BUSES];
+uint32_t busWaitTimeList[NUMBER_OF_BUSES];
+#endif
+
 // I wrote this because rand takes up more room.
 // The RNG does not need to be extremely robust.
 static short generateRandomNumber()
@@ -222,34 +683,124 @@ static byte equalText(byte *text1, byte *text2)
 	}
 }
 
+#if HOST_BUILD
+
 static byte receiveSpiByte()
 {
-	byte output = 0;
-	byte tempMask = 0x80;
+	return hostTransferSpiByte(0);
+}
+
+static void sendSpiByte(byte value)
+{
+	hostTransferSpiByte(value);
+}
+
+#elif SPI_USE_USI
+
+// Strobing USITC from software clocks the USI at a few MHz,
+// which is within the limits of the SRAM, the EEPROM and the display.
+// This is the fast master loop from the datasheet: the first write raises
+// USCK and latches DI, and the second lowers USCK and shifts the register
+// with USICLK, which changes DO. Devices therefore see SPI mode 0.
+static byte transferSpiByte(byte value)
+{
+	USIDR = value;
 	byte tempCount = 0;
 	while (tempCount < 8)
+	{
+		USICR = (1 << USIWM0) | (1 << USITC);
+		USICR = (1 << USIWM0) | (1 << USITC) | (1 << USICLK);
+		tempCount += 1;
+	}
+	return USIDR;
+}
+
+static byte receiveSpiByte()
+{
+	return transferSpiByte(0);
+}
+
+static void sendSpiByte(byte value)
+{
+	transferSpiByte(value);
+}
+
+#else
+
+// The clock edges are a few cycles apart, which is slower than the SRAM,
+// the EEPROM and the display need, so the bits are shifted without delays.
+#if ENABLE_UNROLLED_SPI
+
+#define RECEIVE_SPI_BIT(mask) \
+	SCK_PIN_LOW; \
+	SCK_PIN_HIGH; \
+	if (MISO_PIN_READ) \
+	{ \
+		output |= mask; \
+	}
+
+#define SEND_SPI_BIT(mask) \
+	SCK_PIN_LOW; \
+	if (value & mask) \
+	{ \
+		MOSI_PIN_HIGH; \
+	} else { \
+		MOSI_PIN_LOW; \
+	} \
+	SCK_PIN_HIGH
+
+static byte receiveSpiByte()
+{
+	byte output = 0;
+	RECEIVE_SPI_BIT(0x80);
+	RECEIVE_SPI_BIT(0x40);
+	RECEIVE_SPI_BIT(0x20);
+	RECEIVE_SPI_BIT(0x10);
+	RECEIVE_SPI_BIT(0x08);
+	RECEIVE_SPI_BIT(0x04);
+	RECEIVE_SPI_BIT(0x02);
+	RECEIVE_SPI_BIT(0x01);
+	SCK_PIN_LOW;
+	return output;
+}
+
+static void sendSpiByte(byte value)
+{
+	SEND_SPI_BIT(0x80);
+	SEND_SPI_BIT(0x40);
+	SEND_SPI_BIT(0x20);
+	SEND_SPI_BIT(0x10);
+	SEND_SPI_BIT(0x08);
+	SEND_SPI_BIT(0x04);
+	SEND_SPI_BIT(0x02);
+	SEND_SPI_BIT(0x01);
+	SCK_PIN_LOW;
+}
+
+#else
+
+static byte receiveSpiByte()
+{
+	byte output = 0;
+	byte tempMask = 0x80;
+	while (tempMask)
 	{
 		SCK_PIN_LOW;
-		_delay_us(SPI_DELAY);
 		SCK_PIN_HIGH;
-		_delay_us(SPI_DELAY);
 		if (MISO_PIN_READ)
 		{
 			output |= tempMask;
 		}
 		tempMask >>= 1;
-		tempCount += 1;
 	}
 	SCK_PIN_LOW;
-	_delay_us(SPI_DELAY);
 	return output;
 }
 
 static void sendSpiByte(byte value)
 {
 	byte tempMask = 0x80;
-	byte tempCount = 0;
-	while (tempCount < 8)
+	while (tempMask)
 	{
 		SCK_PIN_LOW;
 		if (value & tempMask)
@@ -258,94 +809,402 @@ static void sendSpiByte(byte value)
 		} else {
 			MOSI_PIN_LOW;
 		}
-		_delay_us(SPI_DELAY);
 		SCK_PIN_HIGH;
-		_delay_us(SPI_DELAY);
 		tempMask >>= 1;
-		tempCount += 1;
 	}
 	SCK_PIN_LOW;
-	_delay_us(SPI_DELAY);
 }
 
+#endif
+
+#endif
+
+#if ENABLE_BUS_COUNTERS
+
+static void countBusBytes(byte bus, short amount)
+{
+	busByteCountList[bus] += amount;
+}
+
+static void countBusTransaction(byte bus, short amount, unsigned short waitTime)
+{
+	busTransactionCountList[bus] += 1;
+	busByteCountList[bus] += amount;
+	busWaitTimeList[bus] += waitTime;
+}
+
+static void clearBusCounters()
+{
+	byte index = 0;
+	while (index < NUMBER_OF_BUSES)
+	{
+		busTransactionCountList[index] = 0;
+		busByteCountList[index] = 0;
+		busWaitTimeList[index] = 0;
+		index += 1;
+	}
+#if SRAM_CACHE_LINE_COUNT
+	sramCacheHitCount = 0;
+	sramCacheMissCount = 0;
+#endif
+}
+
+#endif
+
 static void sendDisplayCommand(byte command)
 {
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(DISPLAY_BUS_INDEX, 1, DISPLAY_COMMAND_DELAY);
+#endif
 	DISPLAY_MODE_PIN_LOW;
 	DISPLAY_CS_PIN_LOW;
 	sendSpiByte(command);
 	DISPLAY_CS_PIN_HIGH;
-	_delay_ms(2);
+	_delay_us(DISPLAY_COMMAND_DELAY);
 }
 
 static void sendDisplayCharacter(byte character)
 {
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(DISPLAY_BUS_INDEX, 1, DISPLAY_CHARACTER_DELAY);
+#endif
 	DISPLAY_MODE_PIN_HIGH;
 	DISPLAY_CS_PIN_LOW;
 	sendSpiByte(character);
 	DISPLAY_CS_PIN_HIGH;
-	_delay_us(50);
+	_delay_us(DISPLAY_CHARACTER_DELAY);
 }
 
+#if ENABLE_DISPLAY_FRAMEBUFFER
+
+// The initialization commands already clear the display, so only
+// the framebuffer needs this.
 static void clearDisplay()
 {
 	sendDisplayCommand(0x01);
+	_delay_ms(DISPLAY_CLEAR_DELAY);
+#if ENABLE_BUS_COUNTERS
+	busWaitTimeList[DISPLAY_BUS_INDEX] += DISPLAY_CLEAR_DELAY * 1000;
+#endif
+	byte index = 0;
+	while (index < DISPLAY_SIZE)
+	{
+		displayFrame[index] = ' ';
+		index += 1;
+	}
+	displayDirtyMask = 0;
+	displayCursorIndex = 0;
 }
 
+#endif
+
 static void setDisplayPos(byte posX, byte posY)
 {
 	sendDisplayCommand(0x80 | posX | (posY * 0x40));
 }
 
-static void clearDisplayRow(byte posY)
+static void sendDisplayCell(byte index, byte character)
 {
-	setDisplayPos(0, posY);
-	byte tempCount = 0;
-	while (tempCount < DISPLAY_WIDTH)
+	if (index != displayCursorIndex)
 	{
-		sendDisplayCharacter(' ');
-		tempCount += 1;
+		setDisplayPos(index % DISPLAY_WIDTH, index / DISPLAY_WIDTH);
+	}
+	sendDisplayCharacter(character);
+	displayCursorIndex = index + 1;
+	// The address counter does not continue onto the next row.
+	if (displayCursorIndex % DISPLAY_WIDTH == 0)
+	{
+		displayCursorIndex = 255;
 	}
 }
 
-static void readSramData(byte *data, short amount, short address)
+// Without the framebuffer, cells are sent as soon as they are drawn.
+static void setDisplayCell(byte index, byte character)
+{
+	if (index >= DISPLAY_SIZE)
+	{
+		return;
+	}
+#if ENABLE_DISPLAY_FRAMEBUFFER
+	if (displayFrame[index] != character)
+	{
+		displayFrame[index] = character;
+		displayDirtyMask |= 1UL << index;
+	}
+#else
+	sendDisplayCell(index, character);
+#endif
+}
+
+static void clearDisplayCells(byte index, byte endIndex)
+{
+	while (index < endIndex)
+	{
+		setDisplayCell(index, ' ');
+		index += 1;
+	}
+}
+
+// Sends the cells which changed since the last flush. The display position
+// is only set when the next dirty cell does not follow the previous one.
+static void flushDisplay()
+{
+#if ENABLE_DISPLAY_FRAMEBUFFER
+	uint32_t tempMask = displayDirtyMask;
+	byte index = 0;
+	while (tempMask)
+	{
+		if (tempMask & 1)
+		{
+			sendDisplayCell(index, displayFrame[index]);
+		}
+		tempMask >>= 1;
+		index += 1;
+	}
+	displayDirtyMask = 0;
+#endif
+}
+
+static void openSramSession(byte instruction, short address)
 {
+#if ENABLE_PROFILER
+	sramTransactionCount += 1;
+#endif
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(SRAM_BUS_INDEX, 3, 0);
+#endif
 	SRAM_CS_PIN_LOW;
-	sendSpiByte(0x03);
+	sendSpiByte(instruction);
 	sendSpiByte((address & 0xFF00) >> 8);
 	sendSpiByte(address & 0x00FF);
+}
+
+#if SRAM_CACHE_LINE_COUNT
+
+static void writeBackSramCacheLine(byte index)
+{
+	byte tempMask = 1 << index;
+	if (sramCacheDirtyMask & tempMask)
+	{
+		openSramSession(0x02, sramCacheLineAddressList[index]);
+		byte tempOffset = 0;
+		while (tempOffset < SRAM_CACHE_LINE_SIZE)
+		{
+			sendSpiByte(sramCacheLineList[index][tempOffset]);
+			tempOffset += 1;
+		}
+		SRAM_CS_PIN_HIGH;
+#if ENABLE_BUS_COUNTERS
+		countBusBytes(SRAM_BUS_INDEX, SRAM_CACHE_LINE_SIZE);
+#endif
+		sramCacheDirtyMask &= ~tempMask;
+	}
+}
+
+static void flushSramCache()
+{
+	byte index = 0;
+	while (index < SRAM_CACHE_LINE_COUNT)
+	{
+		writeBackSramCacheLine(index);
+		index += 1;
+	}
+}
+
+// Returns the cached line which holds the address. If shouldLoad is false,
+// a missing line is not read, because the caller overwrites all of it.
+static byte *getSramCacheLine(short address, byte shouldLoad)
+{
+	short tempLineAddress = address & ~(SRAM_CACHE_LINE_SIZE - 1);
+	byte index = (tempLineAddress / SRAM_CACHE_LINE_SIZE) & (SRAM_CACHE_LINE_COUNT - 1);
+	byte tempMask = 1 << index;
+	byte *output = sramCacheLineList[index];
+	if ((sramCacheValidMask & tempMask) && sramCacheLineAddressList[index] == tempLineAddress)
+	{
+#if ENABLE_BUS_COUNTERS
+		sramCacheHitCount += 1;
+#endif
+		return output;
+	}
+#if ENABLE_BUS_COUNTERS
+	sramCacheMissCount += 1;
+#endif
+	writeBackSramCacheLine(index);
+	if (shouldLoad)
+	{
+		openSramSession(0x03, tempLineAddress);
+		byte tempOffset = 0;
+		while (tempOffset < SRAM_CACHE_LINE_SIZE)
+		{
+			output[tempOffset] = receiveSpiByte();
+			tempOffset += 1;
+		}
+		SRAM_CS_PIN_HIGH;
+#if ENABLE_BUS_COUNTERS
+		countBusBytes(SRAM_BUS_INDEX, SRAM_CACHE_LINE_SIZE);
+#endif
+	}
+	sramCacheLineAddressList[index] = tempLineAddress;
+	sramCacheValidMask |= tempMask;
+	return output;
+}
+
+static byte isSramCacheAccess(short amount, short address)
+{
+	return (address & (SRAM_CACHE_LINE_SIZE - 1)) + amount <= SRAM_CACHE_LINE_SIZE;
+}
+
+#endif
+
+// A session streams consecutive addresses in one transaction, since the SRAM
+// is in sequential mode. Do not talk to any other SPI device until the
+// session is closed.
+static void openSramReadSession(short address)
+{
+#if SRAM_CACHE_LINE_COUNT
+	flushSramCache();
+	sramWriteSessionStartAddress = address;
+	sramWriteSessionEndAddress = address;
+#endif
+	openSramSession(0x03, address);
+}
+
+static void openSramWriteSession(short address)
+{
+#if SRAM_CACHE_LINE_COUNT
+	flushSramCache();
+	sramWriteSessionStartAddress = address;
+	sramWriteSessionEndAddress = address;
+#endif
+	openSramSession(0x02, address);
+}
+
+static byte readNextSramByte()
+{
+#if ENABLE_BUS_COUNTERS
+	countBusBytes(SRAM_BUS_INDEX, 1);
+#endif
+	return receiveSpiByte();
+}
+
+static void writeNextSramByte(byte value)
+{
+#if SRAM_CACHE_LINE_COUNT
+	sramWriteSessionEndAddress += 1;
+#endif
+#if ENABLE_BUS_COUNTERS
+	countBusBytes(SRAM_BUS_INDEX, 1);
+#endif
+	sendSpiByte(value);
+}
+
+static void closeSramSession()
+{
+	SRAM_CS_PIN_HIGH;
+#if SRAM_CACHE_LINE_COUNT
+	// The lines were written back when the session opened, so they can be dropped.
+	byte index = 0;
+	while (index < SRAM_CACHE_LINE_COUNT && sramWriteSessionEndAddress != sramWriteSessionStartAddress)
+	{
+		short tempLineAddress = sramCacheLineAddressList[index];
+		if (tempLineAddress < sramWriteSessionEndAddress && tempLineAddress + SRAM_CACHE_LINE_SIZE > sramWriteSessionStartAddress)
+		{
+			sramCacheValidMask &= ~(1 << index);
+		}
+		index += 1;
+	}
+#endif
+}
+
+static void readSramData(byte *data, short amount, short address)
+{
+#if SRAM_CACHE_LINE_COUNT
+	if (isSramCacheAccess(amount, address))
+	{
+		byte *tempLine = getSramCacheLine(address, true) + (address & (SRAM_CACHE_LINE_SIZE - 1));
+		while (amount > 0)
+		{
+			*data = *tempLine;
+			data += 1;
+			tempLine += 1;
+			amount -= 1;
+		}
+		return;
+	}
+#endif
+	openSramReadSession(address);
 	short tempCount = 0;
 	while (tempCount < amount)
 	{
-		*data = receiveSpiByte();
+		*data = readNextSramByte();
 		data += 1;
 		tempCount += 1;
 	}
-	SRAM_CS_PIN_HIGH;
-	_delay_us(10);
+	closeSramSession();
 }
 
 static void writeSramData(short address, byte *data, short amount)
 {
-	SRAM_CS_PIN_LOW;
-	sendSpiByte(0x02);
-	sendSpiByte((address & 0xFF00) >> 8);
-	sendSpiByte(address & 0x00FF);
+#if SRAM_CACHE_LINE_COUNT
+	if (isSramCacheAccess(amount, address))
+	{
+		byte *tempLine = getSramCacheLine(address, amount < SRAM_CACHE_LINE_SIZE) + (address & (SRAM_CACHE_LINE_SIZE - 1));
+		sramCacheDirtyMask |= 1 << ((address / SRAM_CACHE_LINE_SIZE) & (SRAM_CACHE_LINE_COUNT - 1));
+		while (amount > 0)
+		{
+			*tempLine = *data;
+			data += 1;
+			tempLine += 1;
+			amount -= 1;
+		}
+		return;
+	}
+#endif
+	openSramWriteSession(address);
 	short tempCount = 0;
 	while (tempCount < amount)
 	{
-		sendSpiByte(*data);
+		writeNextSramByte(*data);
 		data += 1;
 		tempCount += 1;
 	}
-	SRAM_CS_PIN_HIGH;
-	_delay_us(10);
+	closeSramSession();
 }
 
-static byte readSramByte(short address)
+static void fillSramData(short address, byte value, short amount)
 {
-	byte output;
-	readSramData(&output, 1, address);
-	return output;
+	openSramWriteSession(address);
+	short tempCount = 0;
+	while (tempCount < amount)
+	{
+		writeNextSramByte(value);
+		tempCount += 1;
+	}
+	closeSramSession();
+}
+
+// Copies in chunks, working backwards when the regions overlap
+// with the destination above the source.
+static void copySramData(short destination, short source, short amount)
+{
+	byte tempBuffer[SRAM_COPY_BUFFER_SIZE];
+	short tempOffset = 0;
+	while (tempOffset < amount)
+	{
+		short tempAmount = SRAM_COPY_BUFFER_SIZE;
+		if (tempOffset + tempAmount > amount)
+		{
+			tempAmount = amount - tempOffset;
+		}
+		short tempChunkOffset = tempOffset;
+		if (destination > source)
+		{
+			tempChunkOffset = amount - tempOffset - tempAmount;
+		}
+		readSramData(tempBuffer, tempAmount, source + tempChunkOffset);
+		writeSramData(destination + tempChunkOffset, tempBuffer, tempAmount);
+		tempOffset += tempAmount;
+	}
 }
 
 static short readSramShort(short address)
@@ -355,30 +1214,31 @@ static short readSramShort(short address)
 	return output;
 }
 
-static long readSramLong(short address)
+static int32_t readSramLong(short address)
 {
-	long output;
+	int32_t output;
 	readSramData((byte *)&output, 4, address);
 	return output;
 }
 
-static void writeSramByte(short address, byte value)
-{
-	writeSramData(address, &value, 1);
-}
-
 static void writeSramShort(short address, short value)
 {
 	writeSramData(address, (byte *)&value, 2);
 }
 
-static void writeSramLong(short address, long value)
+static void writeSramLong(short address, int32_t value)
 {
 	writeSramData(address, (byte *)&value, 4);
 }
 
-static void readEepromData(byte *data, short amount, long address)
+static void readEepromData(byte *data, short amount, int32_t address)
 {
+#if ENABLE_PROFILER
+	eepromTransactionCount += 1;
+#endif
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(EEPROM_BUS_INDEX, amount + 4, 0);
+#endif
 	EEPROM_CS_PIN_LOW;
 	sendSpiByte(0x03);
 	sendSpiByte((address & 0x00FF0000) >> 16);
@@ -392,16 +1252,49 @@ static void readEepromData(byte *data, short amount, long address)
 		tempCount += 1;
 	}
 	EEPROM_CS_PIN_HIGH;
-	_delay_us(10);
 }
 
+#if ENABLE_EEPROM_STATUS_POLLING
+
+static byte readEepromStatus()
+{
+#if ENABLE_PROFILER
+	eepromTransactionCount += 1;
+#endif
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(EEPROM_BUS_INDEX, 2, 0);
+#endif
+	EEPROM_CS_PIN_LOW;
+	sendSpiByte(0x05);
+	byte output = receiveSpiByte();
+	EEPROM_CS_PIN_HIGH;
+	return output;
+}
+
+static uint32_t getTimerCount();
+static uint32_t getElapsedTimerCount(uint32_t startTime);
+
+#endif
+
+static void displayProgmemText(const byte *text);
+static byte promptButton();
+
 // Note: Page write only works within 256 byte boundaries.
-static void writeEepromPage(long address, byte *data, short amount)
+static void writeEepromPage(int32_t address, byte *data, short amount)
 {
+#if PROGRAM_READER_BUFFER_SIZE
+	programReaderBufferAddress = -PROGRAM_READER_BUFFER_SIZE;
+#endif
+#if ENABLE_PROFILER
+	eepromTransactionCount += 2;
+#endif
+#if ENABLE_BUS_COUNTERS
+	countBusTransaction(EEPROM_BUS_INDEX, 1, 0);
+	countBusTransaction(EEPROM_BUS_INDEX, amount + 4, 0);
+#endif
 	EEPROM_CS_PIN_LOW;
 	sendSpiByte(0x06);
 	EEPROM_CS_PIN_HIGH;
-	_delay_ms(1);
 	EEPROM_CS_PIN_LOW;
 	sendSpiByte(0x02);
 	sendSpiByte((address & 0x00FF0000) >> 16);
@@ -415,15 +1308,59 @@ static void writeEepromPage(long address, byte *data, short amount)
 		tempCount += 1;
 	}
 	EEPROM_CS_PIN_HIGH;
-	_delay_ms(10);
-}
-
-static void writeEepromData(long address, byte *data, short amount)
-{
+#if ENABLE_EEPROM_STATUS_POLLING
+	// Wait until the write in progress bit clears.
+	// The busy time is measured with Timer 0.
+	uint32_t tempStartTime = getTimerCount();
+	unsigned short tempTime;
+#if ENABLE_BUS_COUNTERS
+	unsigned short tempReadTime = 0;
+#endif
+	byte tempStatus;
+	while (true)
+	{
+		tempStatus = readEepromStatus();
+#if ENABLE_BUS_COUNTERS
+		tempReadTime += EEPROM_STATUS_READ_TIME;
+#endif
+		tempTime = getElapsedTimerCount(tempStartTime) * TIMER_COUNT_TIME;
+		if (!(tempStatus & 0x01) || tempTime >= EEPROM_WRITE_TIMEOUT)
+		{
+			break;
+		}
+		_delay_us(EEPROM_WRITE_POLL_DELAY);
+	}
+	lastEepromPageWriteTime = tempTime;
+#if ENABLE_BUS_COUNTERS
+	// The status reads are already counted as bus bytes.
+	if (tempTime > tempReadTime)
+	{
+		busWaitTimeList[EEPROM_BUS_INDEX] += tempTime - tempReadTime;
+	}
+#endif
+	if (tempTime > maximumEepromPageWriteTime)
+	{
+		maximumEepromPageWriteTime = tempTime;
+	}
+	if (tempStatus & 0x01)
+	{
+		displayProgmemText(MESSAGE_12);
+		promptButton();
+	}
+#else
+	_delay_ms(EEPROM_WRITE_DELAY);
+#if ENABLE_BUS_COUNTERS
+	busWaitTimeList[EEPROM_BUS_INDEX] += EEPROM_WRITE_DELAY * 1000UL;
+#endif
+#endif
+}
+
+static void writeEepromData(int32_t address, byte *data, short amount)
+{
 	short tempCount = 0;
 	while (tempCount < amount)
 	{
-		long tempEndAddress = (address + 256) & 0xFFFFFF00;
+		int32_t tempEndAddress = (address + 256) & 0xFFFFFF00;
 		short tempAmount = tempEndAddress - address;
 		short tempAmount2 = amount - tempCount;
 		if (tempAmount > tempAmount2)
@@ -437,57 +1374,280 @@ static void writeEepromData(long address, byte *data, short amount)
 	}
 }
 
-static byte readEepromByte(long address)
+static byte readEepromByte(int32_t address)
 {
 	byte output;
 	readEepromData(&output, 1, address);
 	return output;
 }
 
-static byte readButton(byte mask)
+// The program reader hands out program text from a small window of EEPROM.
+// The window is only refilled when the reader leaves it, which happens
+// while reading sequentially or after a jump.
+static byte peekProgramByte()
 {
-	_delay_ms(1);
-	if (!BUTTON_OUTPUT_PIN_READ)
+#if PROGRAM_READER_BUFFER_SIZE
+	int32_t tempOffset = programReaderAddress - programReaderBufferAddress;
+	if (tempOffset < 0 || tempOffset >= PROGRAM_READER_BUFFER_SIZE)
 	{
-		return mask;
+		programReaderBufferAddress = programReaderAddress;
+		readEepromData(programReaderBuffer, PROGRAM_READER_BUFFER_SIZE, programReaderAddress);
+		tempOffset = 0;
 	}
-	return 0;
+	return programReaderBuffer[tempOffset];
+#else
+	return readEepromByte(programReaderAddress);
+#endif
 }
 
-static byte readButtons()
+static byte readProgramByte()
+{
+	byte output = peekProgramByte();
+	programReaderAddress += 1;
+	return output;
+}
+
+// Button index 0 is the left button, and the order follows the button masks.
+static void selectButtonPin(byte index)
 {
-	byte output = 0;
-	LEFT_BUTTON_PIN_OUTPUT;
-	output |= readButton(LEFT_BUTTON_MASK);
 	LEFT_BUTTON_PIN_INPUT;
-	RIGHT_BUTTON_PIN_OUTPUT;
-	output |= readButton(RIGHT_BUTTON_MASK);
 	RIGHT_BUTTON_PIN_INPUT;
-	UP_BUTTON_PIN_OUTPUT;
-	output |= readButton(UP_BUTTON_MASK);
 	UP_BUTTON_PIN_INPUT;
-	DOWN_BUTTON_PIN_OUTPUT;
-	output |= readButton(DOWN_BUTTON_MASK);
 	DOWN_BUTTON_PIN_INPUT;
-	RETURN_BUTTON_PIN_OUTPUT;
-	output |= readButton(RETURN_BUTTON_MASK);
 	RETURN_BUTTON_PIN_INPUT;
-	ESCAPE_BUTTON_PIN_OUTPUT;
-	output |= readButton(ESCAPE_BUTTON_MASK);
 	ESCAPE_BUTTON_PIN_INPUT;
+	if (index == 0)
+	{
+		LEFT_BUTTON_PIN_OUTPUT;
+	} else if (index == 1)
+	{
+		RIGHT_BUTTON_PIN_OUTPUT;
+	} else if (index == 2)
+	{
+		UP_BUTTON_PIN_OUTPUT;
+	} else if (index == 3)
+	{
+		DOWN_BUTTON_PIN_OUTPUT;
+	} else if (index == 4)
+	{
+		RETURN_BUTTON_PIN_OUTPUT;
+	} else {
+		ESCAPE_BUTTON_PIN_OUTPUT;
+	}
+}
+
+#if ENABLE_KEYPAD_INTERRUPT
+
+// Events are dropped when the queue is full.
+static void pushButtonEvent(byte event)
+{
+	byte tempEnd = (buttonEventQueueEnd + 1) % BUTTON_EVENT_QUEUE_SIZE;
+	if (tempEnd != buttonEventQueueStart)
+	{
+		buttonEventQueue[buttonEventQueueEnd] = event;
+		buttonEventQueueEnd = tempEnd;
+	}
+}
+
+// Every tick samples the button selected on the previous tick,
+// so each pin still has a millisecond to settle.
+ISR(TIMER0_COMPA_vect)
+{
+	timerTickCount += 1;
+	if (!BUTTON_OUTPUT_PIN_READ)
+	{
+		buttonScanState |= LEFT_BUTTON_MASK >> buttonScanIndex;
+	}
+	buttonScanIndex += 1;
+	if (buttonScanIndex >= NUMBER_OF_BUTTONS)
+	{
+		buttonScanIndex = 0;
+		if (buttonScanState != lastButtonScanState)
+		{
+			lastButtonScanState = buttonScanState;
+			buttonStableScanCount = 1;
+		} else if (buttonStableScanCount < BUTTON_DEBOUNCE_SCANS)
+		{
+			buttonStableScanCount += 1;
+		}
+		if (buttonStableScanCount >= BUTTON_DEBOUNCE_SCANS)
+		{
+			byte tempPressedButtons = buttonScanState & ~buttonState;
+			byte tempReleasedButtons = buttonState & ~buttonScanState;
+			if (tempPressedButtons)
+			{
+				pushButtonEvent(tempPressedButtons);
+			}
+			if (tempReleasedButtons)
+			{
+				pushButtonEvent(tempReleasedButtons | BUTTON_RELEASE_EVENT_FLAG);
+			}
+			buttonState = buttonScanState;
+		}
+		buttonScanState = 0;
+	}
+	selectButtonPin(buttonScanIndex);
+}
+
+#elif USE_TIMER
+
+ISR(TIMER0_COMPA_vect)
+{
+	timerTickCount += 1;
+}
+
+#elif HOST_BUILD
+
+// host.c calls the handler when the timer fires, which never happens here.
+ISR(TIMER0_COMPA_vect)
+{
+	
+}
+
+#endif
+
+#if USE_TIMER
+
+static void initializeTimer()
+{
+	TCCR0A = (1 << CTC0);
+	OCR0A = TIMER_COMPARE_VALUE;
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	TIMSK |= (1 << OCIE0A);
+}
+
+#endif
+
+#if ENABLE_EEPROM_STATUS_POLLING || ENABLE_PROFILER
+
+// Returns the time in timer counts, which are TIMER_PRESCALER cycles long.
+// The count wraps around together with the tick count.
+static uint32_t getTimerCount()
+{
+	byte tempStatus = SREG;
+	cli();
+	unsigned short tempTickCount = timerTickCount;
+	byte tempCount = TCNT0L;
+	// The interrupt of a compare match which just happened is still pending.
+	if ((TIFR & (1 << OCF0A)) && tempCount < (TIMER_COMPARE_VALUE + 1) / 2)
+	{
+		tempTickCount += 1;
+	}
+	SREG = tempStatus;
+	return tempTickCount * (uint32_t)(TIMER_COMPARE_VALUE + 1) + tempCount;
+}
+
+static uint32_t getElapsedTimerCount(uint32_t startTime)
+{
+	uint32_t output = getTimerCount();
+	if (output < startTime)
+	{
+		output += 65536UL * (TIMER_COMPARE_VALUE + 1);
+	}
+	return output - startTime;
+}
+
+#endif
+
+#if ENABLE_PROFILER
+
+// Called around prompts so that the profile leaves out the time
+// spent waiting for the user.
+static void pauseProfiling()
+{
+	profilePauseStartTime = getTimerCount();
+}
+
+static void resumeProfiling()
+{
+	profilePausedTime += getElapsedTimerCount(profilePauseStartTime);
+}
+
+#endif
+
+// Called by loops which busy wait for the buttons to change.
+// Time only passes in the host build when something waits.
+static void waitForButtons()
+{
+#if HOST_BUILD
+	sleep_mode();
+#endif
+}
+
+#if ENABLE_KEYPAD_INTERRUPT
+
+static byte readButtons()
+{
+	return buttonState;
+}
+
+// Returns 0 if there is no pending event.
+static byte readButtonEvent()
+{
+	if (buttonEventQueueStart == buttonEventQueueEnd)
+	{
+		return 0;
+	}
+	byte output = buttonEventQueue[buttonEventQueueStart];
+	buttonEventQueueStart = (buttonEventQueueStart + 1) % BUTTON_EVENT_QUEUE_SIZE;
+	return output;
+}
+
+static void clearButtonEvents()
+{
+	buttonEventQueueStart = buttonEventQueueEnd;
+}
+
+// Looks for an escape press in the queue without taking events from it,
+// so that presses meant for INPUT stay queued.
+static byte hasPendingEscapePress()
+{
+	byte index = buttonEventQueueStart;
+	while (index != buttonEventQueueEnd)
+	{
+		byte tempEvent = buttonEventQueue[index];
+		if ((tempEvent & ESCAPE_BUTTON_MASK) && !(tempEvent & BUTTON_RELEASE_EVENT_FLAG))
+		{
+			return true;
+		}
+		index = (index + 1) % BUTTON_EVENT_QUEUE_SIZE;
+	}
+	return false;
+}
+
+#else
+
+// Leaves the escape button selected, so that its pin can be read
+// afterwards without waiting for it to settle.
+static byte readButtons()
+{
+	byte output = 0;
+	byte index = 0;
+	while (index < NUMBER_OF_BUTTONS)
+	{
+		selectButtonPin(index);
+		_delay_ms(1);
+		if (!BUTTON_OUTPUT_PIN_READ)
+		{
+			output |= LEFT_BUTTON_MASK >> index;
+		}
+		index += 1;
+	}
 	return output;
 }
 
+#endif
+
 // Destination should have size at least MAXIMUM_FILE_NAME_LENGTH + 1.
 static void getFileName(byte *destination, byte index)
 {
-	long tempAddress = index * (long)FILE_ENTRY_SIZE;
+	int32_t tempAddress = index * (int32_t)FILE_ENTRY_SIZE;
 	readEepromData(destination, MAXIMUM_FILE_NAME_LENGTH + 1, tempAddress);
 }
 
 static void displayText(byte *message);
-static byte promptButton();
 
+#if !HOST_BUILD
 static void displayAvailableMemory() {
 	/*
 	int size = 512;
@@ -510,10 +1670,11 @@ static void displayAvailableMemory() {
 	displayText(tempText);
 	promptButton();
 }
+#endif
 
 static void __attribute__ ((noinline)) loadFile(byte index)
 {
-	long tempStartAddress = index * (long)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
+	int32_t tempStartAddress = index * (int32_t)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
 	short tempOffset = 0;
 	short tempEndOffset = FILE_ENTRY_SIZE - FILE_DATA_OFFSET;
 	while (tempOffset < tempEndOffset)
@@ -532,7 +1693,7 @@ static void __attribute__ ((noinline)) loadFile(byte index)
 
 static void __attribute__ ((noinline)) saveFile(byte index)
 {
-	long tempStartAddress = index * (long)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
+	int32_t tempStartAddress = index * (int32_t)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
 	short tempOffset = 0;
 	short tempEndOffset = FILE_ENTRY_SIZE - FILE_DATA_OFFSET;
 	while (tempOffset < tempEndOffset)
@@ -549,61 +1710,70 @@ static void __attribute__ ((noinline)) saveFile(byte index)
 	}
 }
 
+// Waits for the next button press. Release events are skipped.
 static byte promptButton()
 {
+#if ENABLE_KEYPAD_INTERRUPT
+	while (true)
+	{
+		byte tempEvent = readButtonEvent();
+		if (tempEvent && !(tempEvent & BUTTON_RELEASE_EVENT_FLAG))
+		{
+			return tempEvent;
+		}
+		if (!tempEvent)
+		{
+			// The timer interrupt wakes us up.
+			sleep_mode();
+		}
+	}
+#else
 	byte output = 0;
 	while (!output)
 	{
+		waitForButtons();
 		output = readButtons();
 	}
-	byte tempValue = output;
-	while (tempValue)
+	while (readButtons())
 	{
-		tempValue = readButtons();
+		waitForButtons();
 	}
 	return output;
+#endif
 }
 
 static void displayText(byte *text)
 {
-	clearDisplay();
-	setDisplayPos(0, 0);
 	byte index = 0;
-	while (true)
+	while (index < DISPLAY_SIZE)
 	{
 		byte tempCharacter = text[index];
 		if (tempCharacter == 0)
 		{
 			break;
 		}
-		if (index == DISPLAY_WIDTH)
-		{
-			setDisplayPos(0, 1);
-		}
-		sendDisplayCharacter(tempCharacter);
+		setDisplayCell(index, tempCharacter);
 		index += 1;
 	}
+	clearDisplayCells(index, DISPLAY_SIZE);
+	flushDisplay();
 }
 
 static void displayProgmemText(const byte *text)
 {
-	clearDisplay();
-	setDisplayPos(0, 0);
 	byte index = 0;
-	while (true)
+	while (index < DISPLAY_SIZE)
 	{
 		byte tempCharacter = pgm_read_byte(text + index);
 		if (tempCharacter == 0)
 		{
 			break;
 		}
-		if (index == DISPLAY_WIDTH)
-		{
-			setDisplayPos(0, 1);
-		}
-		sendDisplayCharacter(tempCharacter);
+		setDisplayCell(index, tempCharacter);
 		index += 1;
 	}
+	clearDisplayCells(index, DISPLAY_SIZE);
+	flushDisplay();
 }
 
 // Returns 255 if escape was pressed.
@@ -651,8 +1821,6 @@ static void editTextLine(byte *text)
 	short tempCharacterIndex = 0;
 	while (true)
 	{
-		clearDisplay();
-		setDisplayPos(0, 0);
 		short tempLength = getTextLength(text);
 		short tempStartIndex;
 		if (tempCursorIndex < DISPLAY_WIDTH / 2)
@@ -670,7 +1838,7 @@ static void editTextLine(byte *text)
 			short tempIndex = tempStartIndex + tempOffset;
 			if (tempIndex == tempCursorIndex)
 			{
-				sendDisplayCharacter(EDIT_CURSOR_CHARACTER);
+				setDisplayCell(tempCount, EDIT_CURSOR_CHARACTER);
 				tempCount += 1;
 			}
 			if (tempCount < DISPLAY_WIDTH)
@@ -682,14 +1850,17 @@ static void editTextLine(byte *text)
 				}
 				if (!hasFoundLastCharacter)
 				{
-					sendDisplayCharacter(tempCharacter);
+					setDisplayCell(tempCount, tempCharacter);
 					tempCount += 1;
 				}
 			}
 			tempOffset += 1;
 		}
+		clearDisplayCells(tempCount, DISPLAY_WIDTH);
 		if (tempEditState == 0)
 		{
+			clearDisplayCells(DISPLAY_WIDTH, DISPLAY_SIZE);
+			flushDisplay();
 			byte tempButtons = promptButton();
 			if (tempButtons & LEFT_BUTTON_MASK)
 			{
@@ -727,21 +1898,22 @@ static void editTextLine(byte *text)
 		{
 			while (true)
 			{
-				clearDisplayRow(1);
-				setDisplayPos(0, 1);
+				byte tempOffset = 0;
 				if (tempCharacterIndex < NUMBER_OF_SPECIAL_CHARACTERS)
 				{
-					byte tempOffset = 0;
 					while (tempOffset < SPECIAL_CHARACTER_LENGTH)
 					{
 						byte tempCharacter = pgm_read_byte(SPECIAL_CHARACTER_SET + tempCharacterIndex * SPECIAL_CHARACTER_LENGTH + tempOffset);
-						sendDisplayCharacter(tempCharacter);
+						setDisplayCell(DISPLAY_WIDTH + tempOffset, tempCharacter);
 						tempOffset += 1;
 					}
 				} else {
 					byte tempCharacter = pgm_read_byte(CHARACTER_SET + tempCharacterIndex - NUMBER_OF_SPECIAL_CHARACTERS);
-					sendDisplayCharacter(tempCharacter);
+					setDisplayCell(DISPLAY_WIDTH, tempCharacter);
+					tempOffset = 1;
 				}
+				clearDisplayCells(DISPLAY_WIDTH + tempOffset, DISPLAY_SIZE);
+				flushDisplay();
 				byte tempButtons = promptButton();
 				if (tempButtons & LEFT_BUTTON_MASK)
 				{
@@ -816,7 +1988,8 @@ static short findPreviousLine(short lineIndex)
 	lineIndex -= 2;
 	while (lineIndex >= 0)
 	{
-		byte tempCharacter = readSramByte(lineIndex);
+		byte tempCharacter;
+		readSramData(&tempCharacter, 1, lineIndex);
 		if (tempCharacter == '\n')
 		{
 			return lineIndex + 1;
@@ -828,56 +2001,43 @@ static short findPreviousLine(short lineIndex)
 
 static short findNextLine(short lineIndex)
 {
-	short startLineIndex = lineIndex;
+	short output = lineIndex;
+	openSramReadSession(lineIndex);
 	while (true)
 	{
-		byte tempCharacter = readSramByte(lineIndex);
+		byte tempCharacter = readNextSramByte();
 		if (tempCharacter == '\n')
 		{
-			return lineIndex + 1;
+			output = lineIndex + 1;
+			break;
 		}
 		if (tempCharacter == 0)
 		{
-			return startLineIndex;
+			break;
 		}
 		lineIndex += 1;
 	}
+	closeSramSession();
+	return output;
 }
 
-static void moveLines(short startIndex, short endIndex)
+// Returns the length of the null-terminated text at address.
+static short getSramTextLength(short address)
 {
-	short tempOffset = 0;
-	if (endIndex > startIndex)
-	{
-		while (true)
-		{
-			byte tempCharacter = readSramByte(startIndex + tempOffset);
-			if (tempCharacter == 0)
-			{
-				break;
-			}
-			tempOffset += 1;
-		}
-		while (tempOffset >= 0)
-		{
-			byte tempCharacter = readSramByte(startIndex + tempOffset);
-			writeSramByte(endIndex + tempOffset, tempCharacter);
-			tempOffset -= 1;
-		}
-	}
-	if (endIndex < startIndex)
+	short output = 0;
+	openSramReadSession(address);
+	while (readNextSramByte())
 	{
-		while (true)
-		{
-			byte tempCharacter = readSramByte(startIndex + tempOffset);
-			writeSramByte(endIndex + tempOffset, tempCharacter);
-			if (tempCharacter == 0)
-			{
-				break;
-			}
-			tempOffset += 1;
-		}
+		output += 1;
 	}
+	closeSramSession();
+	return output;
+}
+
+static void moveLines(short startIndex, short endIndex)
+{
+	short tempLength = getSramTextLength(startIndex);
+	copySramData(endIndex, startIndex, tempLength + 1);
 }
 
 static void __attribute__ ((noinline)) editLoadedFile(byte fileIndex)
@@ -885,23 +2045,21 @@ static void __attribute__ ((noinline)) editLoadedFile(byte fileIndex)
 	short tempLineIndex = 0;
 	while (true)
 	{
-		clearDisplay();
-		setDisplayPos(0, 0);
+		byte tempLine[DISPLAY_SIZE];
+		readSramData(tempLine, DISPLAY_SIZE, tempLineIndex);
 		byte tempOffset = 0;
-		while (tempOffset < DISPLAY_WIDTH * 2)
+		while (tempOffset < DISPLAY_SIZE)
 		{
-			byte tempCharacter = readSramByte(tempLineIndex + tempOffset);
+			byte tempCharacter = tempLine[tempOffset];
 			if (tempCharacter == '\n' || tempCharacter == 0)
 			{
 				break;
 			}
-			if (tempOffset == DISPLAY_WIDTH)
-			{
-				setDisplayPos(0, 1);
-			}
-			sendDisplayCharacter(tempCharacter);
+			setDisplayCell(tempOffset, tempCharacter);
 			tempOffset += 1;
 		}
+		clearDisplayCells(tempOffset, DISPLAY_SIZE);
+		flushDisplay();
 		byte tempButtons = promptButton();
 		if (tempButtons & LEFT_BUTTON_MASK)
 		{
@@ -932,10 +2090,11 @@ static void __attribute__ ((noinline)) editLoadedFile(byte fileIndex)
 		if (tempButtons & RETURN_BUTTON_MASK)
 		{
 			byte tempResult = promptProgmemSelection(SELECTION_MENU_1, 3);
+			// Insert and edit share one line buffer, which is most of the stack.
+			byte tempBuffer[256];
 			// Insert.
 			if (tempResult == 0)
 			{
-				byte tempBuffer[256];
 				tempBuffer[0] = 0;
 				editTextLine(tempBuffer);
 				byte tempLength = getTextLength(tempBuffer);
@@ -955,12 +2114,12 @@ static void __attribute__ ((noinline)) editLoadedFile(byte fileIndex)
 			// Edit.
 			if (tempResult == 2)
 			{
-				byte tempBuffer[256];
 				byte tempOffset = 0;
 				byte tempLength = 0;
+				openSramReadSession(tempLineIndex);
 				while (true)
 				{
-					byte tempCharacter = readSramByte(tempLineIndex + tempOffset);
+					byte tempCharacter = readNextSramByte();
 					if (tempCharacter == 0)
 					{
 						break;
@@ -974,6 +2133,7 @@ static void __attribute__ ((noinline)) editLoadedFile(byte fileIndex)
 					tempBuffer[tempOffset] = tempCharacter;
 					tempOffset += 1;
 				}
+				closeSramSession();
 				tempBuffer[tempOffset] = 0;
 				editTextLine(tempBuffer);
 				byte tempLength2 = getTextLength(tempBuffer);
@@ -1011,7 +2171,7 @@ static void editFile(byte fileIndex)
 static byte getNumberOfFiles()
 {
 	byte output = 0;
-	long tempAddress = 0;
+	int32_t tempAddress = 0;
 	byte index = 0;
 	while (index < NUMBER_OF_FILE_ENTRY_POSITIONS)
 	{
@@ -1029,7 +2189,7 @@ static byte getNumberOfFiles()
 static byte getFileIndexByNumber(byte number)
 {
 	byte output = 0;
-	long tempAddress = 0;
+	int32_t tempAddress = 0;
 	byte index = 0;
 	while (index < NUMBER_OF_FILE_ENTRY_POSITIONS)
 	{
@@ -1049,23 +2209,124 @@ static byte getFileIndexByNumber(byte number)
 	return 255;
 }
 
+#if ENABLE_SCOPE_VARIABLE_CACHE
+
+// Variables which were never assigned must also hold 0 in the list,
+// because saveScopeVariables stores the whole list in the scope, and
+// the arguments of a call are read from there.
 static void initializeScopeVariables()
 {
+	scopeVariableMask = 0;
 	byte index = 0;
 	while (index < NUMBER_OF_SCOPE_VARIABLES)
 	{
-		short tempAddress = scopeAddress + SCOPE_VARIABLE_LIST_OFFSET + index * 2;
-		writeSramShort(tempAddress, 0);
+		scopeVariableList[index] = 0;
+		index += 1;
+	}
+}
+
+// Writes the mask and the variables in one transaction.
+static void saveScopeVariables()
+{
+	openSramWriteSession(scopeAddress + SCOPE_VARIABLE_MASK_OFFSET);
+	byte index = 0;
+	while (index < 4)
+	{
+		writeNextSramByte(((byte *)&scopeVariableMask)[index]);
+		index += 1;
+	}
+	index = 0;
+	while (index < NUMBER_OF_SCOPE_VARIABLES * 2)
+	{
+		writeNextSramByte(((byte *)scopeVariableList)[index]);
+		index += 1;
+	}
+	closeSramSession();
+}
+
+static void loadScopeVariables()
+{
+	openSramReadSession(scopeAddress + SCOPE_VARIABLE_MASK_OFFSET);
+	byte index = 0;
+	while (index < 4)
+	{
+		((byte *)&scopeVariableMask)[index] = readNextSramByte();
+		index += 1;
+	}
+	index = 0;
+	while (index < NUMBER_OF_SCOPE_VARIABLES * 2)
+	{
+		((byte *)scopeVariableList)[index] = readNextSramByte();
 		index += 1;
 	}
+	closeSramSession();
+}
+
+// Returns 255 if the address is not a variable of the current scope.
+static byte findScopeVariable(short address)
+{
+	unsigned short tempOffset = address - (scopeAddress + SCOPE_VARIABLE_LIST_OFFSET);
+	if (tempOffset < NUMBER_OF_SCOPE_VARIABLES * 2)
+	{
+		return tempOffset / 2;
+	}
+	return 255;
+}
+
+// References are read and written through these functions,
+// so that variables of the current scope stay in internal RAM.
+static short readReference(short address)
+{
+	byte tempIndex = findScopeVariable(address);
+	if (tempIndex != 255)
+	{
+		if (scopeVariableMask & (1UL << tempIndex))
+		{
+			return scopeVariableList[tempIndex];
+		}
+		return 0;
+	}
+	return readSramShort(address);
+}
+
+static void writeReference(short address, short reference)
+{
+	byte tempIndex = findScopeVariable(address);
+	if (tempIndex != 255)
+	{
+		scopeVariableList[tempIndex] = reference;
+		scopeVariableMask |= 1UL << tempIndex;
+	} else {
+		writeSramShort(address, reference);
+	}
+}
+
+#else
+
+// Clears the variables of the scope in one transaction.
+static void initializeScopeVariables()
+{
+	fillSramData(scopeAddress + SCOPE_VARIABLE_LIST_OFFSET, 0, NUMBER_OF_SCOPE_VARIABLES * 2);
+}
+
+static short readReference(short address)
+{
+	return readSramShort(address);
 }
 
+static void writeReference(short address, short reference)
+{
+	writeSramShort(address, reference);
+}
+
+#endif
+
 // Returns 255 if the function could not be found.
 static byte findBuiltInFunction(byte *name)
 {
 	byte output = 0;
 	short index = 0;
-	while (index < sizeof(BUILT_IN_FUNCTION_NAME_LIST))
+	while (index < sizeof(BUILT_IN_FUNCTION_NAME_LIST) - 1)
 	{
 		byte hasFoundDifference = false;
 		byte tempOffset = 0;
@@ -1104,28 +2365,63 @@ static byte findBuiltInFunction(byte *name)
 
 static void setHeapEntryReference(short referenceAddress, short reference);
 
+static byte isTaggedInteger(short pointer)
+{
+#if ENABLE_TAGGED_INTEGERS
+	return pointer & TAGGED_INTEGER_FLAG;
+#else
+	return false;
+#endif
+}
+
+// The getters treat tagged integers as integer heap entries.
 static short getHeapEntryType(short address)
 {
+	if (isTaggedInteger(address))
+	{
+		return INTEGER_HEAP_ENTRY_TYPE;
+	}
 	return readSramShort(address + HEAP_ENTRY_TYPE_OFFSET);
 }
 
 static short getHeapEntryData(short address)
 {
+	if (isTaggedInteger(address))
+	{
+		return address >> 1;
+	}
 	return readSramShort(address + HEAP_ENTRY_DATA_OFFSET);
 }
 
 static short getHeapEntryLink(short address)
 {
+	if (isTaggedInteger(address))
+	{
+		return 0;
+	}
 	return readSramShort(address + HEAP_ENTRY_LINK_OFFSET);
 }
 
-static void setHeapEntryType(short address, short type)
+// Reads the data and link fields in one transaction.
+// Destination should have size at least 2.
+static void getHeapEntryDataAndLink(short *destination, short address)
 {
-	writeSramShort(address + HEAP_ENTRY_TYPE_OFFSET, type);
+	if (isTaggedInteger(address))
+	{
+		destination[0] = address >> 1;
+		destination[1] = 0;
+		return;
+	}
+	readSramData((byte *)destination, 4, address + HEAP_ENTRY_DATA_OFFSET);
 }
 
+// Tagged integers can not be changed in place.
 static void setHeapEntryData(short address, short data)
 {
+	if (isTaggedInteger(address))
+	{
+		return;
+	}
 	short tempAddress = address + HEAP_ENTRY_DATA_OFFSET;
 	if (getHeapEntryType(address) == LIST_HEAP_ENTRY_TYPE)
 	{
@@ -1137,16 +2433,147 @@ static void setHeapEntryData(short address, short data)
 
 static void setHeapEntryLink(short address, short link)
 {
+	if (isTaggedInteger(address))
+	{
+		return;
+	}
 	setHeapEntryReference(address + HEAP_ENTRY_LINK_OFFSET, link);
 }
 
-static void changeHeapEntryReferenceCount(short address, short offset)
+static void resetHeap()
 {
-	short tempCount = readSramShort(address + HEAP_ENTRY_REFERENCE_COUNT_OFFSET);
-	tempCount += offset;
-	if (tempCount < 1)
-	{
-		short tempType = getHeapEntryType(address);
+	heapSize = 0;
+#if ENABLE_HEAP_FREE_LIST
+	freeHeapEntryAddress = 0;
+#endif
+#if ENABLE_ARRAYS
+	freeHeapBlockAddress = 0;
+#endif
+}
+
+static void releaseHeapEntry(short address)
+{
+#if ENABLE_HEAP_FREE_LIST
+	short tempEntry[HEAP_ENTRY_SIZE / 2] = {EMPTY_HEAP_ENTRY_TYPE, 0, 0, freeHeapEntryAddress};
+	writeSramData(address, (byte *)tempEntry, HEAP_ENTRY_SIZE);
+	freeHeapEntryAddress = address;
+#else
+	writeSramShort(address + HEAP_ENTRY_TYPE_OFFSET, EMPTY_HEAP_ENTRY_TYPE);
+#endif
+}
+
+#if ENABLE_PACKED_STRINGS
+
+static void releaseStringChunks(short address)
+{
+	while (address)
+	{
+		short tempNextAddress = readSramShort(address + HEAP_ENTRY_LINK_OFFSET);
+		releaseHeapEntry(address);
+		address = tempNextAddress;
+	}
+}
+
+#endif
+
+#if ENABLE_ARRAYS
+
+// Returns the address of a block of consecutive heap entries. The
+// smallest free block which is large enough gives up its last entries,
+// and otherwise the block is taken from the end of the heap.
+static short takeHeapBlock(short numberOfEntries)
+{
+	short tempPreviousAddress = 0;
+	short tempAddress = freeHeapBlockAddress;
+	short tempBestPreviousAddress = 0;
+	short tempBestAddress = 0;
+	short tempBestSize = 0;
+	while (tempAddress)
+	{
+		short tempEntry[HEAP_ENTRY_SIZE / 2];
+		readSramData((byte *)tempEntry, HEAP_ENTRY_SIZE, tempAddress);
+		short tempSize = tempEntry[FREE_HEAP_BLOCK_SIZE_OFFSET / 2];
+		if (tempSize >= numberOfEntries && (tempBestAddress == 0 || tempSize < tempBestSize))
+		{
+			tempBestPreviousAddress = tempPreviousAddress;
+			tempBestAddress = tempAddress;
+			tempBestSize = tempSize;
+			if (tempSize == numberOfEntries)
+			{
+				break;
+			}
+		}
+		tempPreviousAddress = tempAddress;
+		tempAddress = tempEntry[HEAP_ENTRY_LINK_OFFSET / 2];
+	}
+	if (tempBestAddress == 0)
+	{
+		heapSize += numberOfEntries * HEAP_ENTRY_SIZE;
+		return HEAP_START_ADDRESS - heapSize + HEAP_ENTRY_SIZE;
+	}
+	if (tempBestSize > numberOfEntries)
+	{
+		tempBestSize -= numberOfEntries;
+		writeSramShort(tempBestAddress + FREE_HEAP_BLOCK_SIZE_OFFSET, tempBestSize);
+		return tempBestAddress + tempBestSize * HEAP_ENTRY_SIZE;
+	}
+	short tempNextAddress = getHeapEntryLink(tempBestAddress);
+	if (tempBestPreviousAddress)
+	{
+		writeSramShort(tempBestPreviousAddress + HEAP_ENTRY_LINK_OFFSET, tempNextAddress);
+	} else {
+		freeHeapBlockAddress = tempNextAddress;
+	}
+	return tempBestAddress;
+}
+
+static void releaseHeapBlock(short address, short numberOfEntries)
+{
+	short tempEntry[HEAP_ENTRY_SIZE / 2] = {numberOfEntries, 0, 0, freeHeapBlockAddress};
+	writeSramData(address, (byte *)tempEntry, HEAP_ENTRY_SIZE);
+	freeHeapBlockAddress = address;
+}
+
+// The capacity is rounded up to fill the last heap entry of the block.
+static short allocateArrayBlock(short capacity)
+{
+	short tempNumberOfEntries = (ARRAY_ELEMENT_LIST_OFFSET + capacity * 2 + HEAP_ENTRY_SIZE - 1) / HEAP_ENTRY_SIZE;
+	short output = takeHeapBlock(tempNumberOfEntries);
+	writeSramShort(output + ARRAY_CAPACITY_OFFSET, (tempNumberOfEntries * HEAP_ENTRY_SIZE - ARRAY_ELEMENT_LIST_OFFSET) / 2);
+	return output;
+}
+
+static void releaseArrayBlock(short address)
+{
+	short tempCapacity = readSramShort(address + ARRAY_CAPACITY_OFFSET);
+	releaseHeapBlock(address, (ARRAY_ELEMENT_LIST_OFFSET + tempCapacity * 2) / HEAP_ENTRY_SIZE);
+}
+
+// Releases the element references from the start index up to the end index.
+static void releaseArrayElements(short blockAddress, short startIndex, short endIndex)
+{
+	while (startIndex < endIndex)
+	{
+		setHeapEntryReference(blockAddress + ARRAY_ELEMENT_LIST_OFFSET + startIndex * 2, 0);
+		startIndex += 1;
+	}
+}
+
+#endif
+
+static void changeHeapEntryReferenceCount(short address, short offset)
+{
+	short tempCount = readSramShort(address + HEAP_ENTRY_REFERENCE_COUNT_OFFSET);
+#if ENABLE_CONSTANT_TABLE
+	if (tempCount >= CONSTANT_REFERENCE_COUNT)
+	{
+		return;
+	}
+#endif
+	tempCount += offset;
+	if (tempCount < 1)
+	{
+		short tempType = getHeapEntryType(address);
 		if (tempType == LIST_HEAP_ENTRY_TYPE)
 		{
 			// All Heap entries in the list chain should have a reference count of 1.
@@ -1156,49 +2583,86 @@ static void changeHeapEntryReferenceCount(short address, short offset)
 				short tempNextAddress = getHeapEntryLink(address);
 				// Using setHeapEntryLink would cause recursion.
 				setHeapEntryData(address, 0);
-				setHeapEntryType(address, EMPTY_HEAP_ENTRY_TYPE);
+				releaseHeapEntry(address);
 				if (!tempNextAddress)
 				{
 					break;
 				}
 				address = tempNextAddress;
 			}
+#if ENABLE_PACKED_STRINGS
+		} else if (tempType == STRING_HEAP_ENTRY_TYPE)
+		{
+			releaseStringChunks(getHeapEntryLink(address));
+			releaseHeapEntry(address);
+#endif
+#if ENABLE_ARRAYS
+		} else if (tempType == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			short tempDataAndLink[2];
+			getHeapEntryDataAndLink(tempDataAndLink, address);
+			releaseArrayElements(tempDataAndLink[1], 0, tempDataAndLink[0]);
+			releaseArrayBlock(tempDataAndLink[1]);
+			releaseHeapEntry(address);
+#endif
 		} else {
-			setHeapEntryType(address, EMPTY_HEAP_ENTRY_TYPE);
+			releaseHeapEntry(address);
 		}
 	} else {
 		writeSramShort(address + HEAP_ENTRY_REFERENCE_COUNT_OFFSET, tempCount);
 	}
 }
 
-static short allocateHeapEntry(short type)
+// Returns an unused heap entry without initializing it.
+static short takeHeapEntry()
 {
+#if ENABLE_HEAP_FREE_LIST
+	short output;
+	if (freeHeapEntryAddress)
+	{
+		output = freeHeapEntryAddress;
+		freeHeapEntryAddress = getHeapEntryLink(output);
+#if ENABLE_ARRAYS
+	} else if (freeHeapBlockAddress)
+	{
+		output = takeHeapBlock(1);
+#endif
+	} else {
+		output = HEAP_START_ADDRESS - heapSize;
+		heapSize += HEAP_ENTRY_SIZE;
+	}
+	return output;
+#else
 	short tempOffset = 0;
-	byte hasFoundEmptyEntry = false;
 	while (tempOffset < heapSize)
 	{
-		short tempType = readSramShort(HEAP_START_ADDRESS - tempOffset);
-		if (tempType == EMPTY_HEAP_ENTRY_TYPE)
+		if (readSramShort(HEAP_START_ADDRESS - tempOffset + HEAP_ENTRY_TYPE_OFFSET) == EMPTY_HEAP_ENTRY_TYPE)
 		{
-			hasFoundEmptyEntry = true;
-			break;
+			return HEAP_START_ADDRESS - tempOffset;
 		}
 		tempOffset += HEAP_ENTRY_SIZE;
 	}
-	if (!hasFoundEmptyEntry)
-	{
-		heapSize += HEAP_ENTRY_SIZE;
-	}
-	short tempAddress = HEAP_START_ADDRESS - tempOffset;
-	writeSramShort(tempAddress + HEAP_ENTRY_TYPE_OFFSET, type);
-	writeSramShort(tempAddress + HEAP_ENTRY_REFERENCE_COUNT_OFFSET, 0);
-	writeSramShort(tempAddress + HEAP_ENTRY_DATA_OFFSET, 0);
-	writeSramShort(tempAddress + HEAP_ENTRY_LINK_OFFSET, 0);
+	heapSize += HEAP_ENTRY_SIZE;
+	return HEAP_START_ADDRESS - tempOffset;
+#endif
+}
+
+static short allocateHeapEntry(short type)
+{
+	short tempAddress = takeHeapEntry();
+	short tempEntry[HEAP_ENTRY_SIZE / 2] = {type, 0, 0, 0};
+	writeSramData(tempAddress, (byte *)tempEntry, HEAP_ENTRY_SIZE);
 	return tempAddress;
 }
 
 static short allocateInteger(short value)
 {
+#if ENABLE_TAGGED_INTEGERS
+	if (value >= MINIMUM_TAGGED_INTEGER && value <= MAXIMUM_TAGGED_INTEGER)
+	{
+		return (short)(((unsigned short)value << 1) | TAGGED_INTEGER_FLAG);
+	}
+#endif
 	short output = allocateHeapEntry(INTEGER_HEAP_ENTRY_TYPE);
 	setHeapEntryData(output, value);
 	return output;
@@ -1211,42 +2675,333 @@ static short allocateList(short pointer)
 	return output;
 }
 
+#if ENABLE_PACKED_STRINGS
+
+// Chunk should have the size of a heap entry. Its link is overwritten.
+// Returns the address of the new chunk.
+static short appendStringChunk(short previousAddress, byte *chunk)
+{
+	short output = takeHeapEntry();
+	*(short *)(chunk + HEAP_ENTRY_LINK_OFFSET) = 0;
+	writeSramData(output, chunk, HEAP_ENTRY_SIZE);
+	writeSramShort(previousAddress + HEAP_ENTRY_LINK_OFFSET, output);
+	return output;
+}
+
+#endif
+
+// If text is null, the text is read from the program reader
+// up to the closing quote.
 static short allocateText(byte *text)
 {
+#if ENABLE_PACKED_STRINGS
+	short output = allocateHeapEntry(STRING_HEAP_ENTRY_TYPE);
+	short tempPreviousAddress = output;
+	short tempLength = 0;
+	byte tempChunk[HEAP_ENTRY_SIZE];
+#else
 	short output = 0;
 	short tempPointer = 0;
+#endif
 	while (true)
 	{
-		byte tempCharacter = *text;
-		short tempPointer2 = allocateInteger(tempCharacter);
-		short tempPointer3 = allocateList(tempPointer2);
+		byte tempCharacter;
+		if (text)
+		{
+			tempCharacter = *text;
+			text += 1;
+		} else {
+			tempCharacter = readProgramByte();
+			if (tempCharacter == '"')
+			{
+				tempCharacter = 0;
+			}
+		}
+#if ENABLE_PACKED_STRINGS
+		tempChunk[tempLength % STRING_CHUNK_SIZE] = tempCharacter;
+		tempLength += 1;
+		if (tempCharacter == 0 || tempLength % STRING_CHUNK_SIZE == 0)
+		{
+			tempPreviousAddress = appendStringChunk(tempPreviousAddress, tempChunk);
+		}
+#else
+		short tempPointer2 = allocateList(allocateInteger(tempCharacter));
 		if (tempPointer == 0)
 		{
-			output = tempPointer3;
+			output = tempPointer2;
 		} else {
-			setHeapEntryLink(tempPointer, tempPointer3);
+			setHeapEntryLink(tempPointer, tempPointer2);
 		}
-		tempPointer = tempPointer3;
+		tempPointer = tempPointer2;
+#endif
 		if (tempCharacter == 0)
 		{
-			return output;
+			break;
 		}
-		text += 1;
 	}
+#if ENABLE_PACKED_STRINGS
+	writeSramShort(output + HEAP_ENTRY_DATA_OFFSET, tempLength);
+#endif
+	return output;
+}
+
+#if ENABLE_PACKED_STRINGS
+
+// Returns the chunk which holds the character at the index,
+// and changes the index to an offset in that chunk.
+static short findStringChunk(short pointer, short *index)
+{
+	short output = getHeapEntryLink(pointer);
+	while (*index >= STRING_CHUNK_SIZE)
+	{
+		output = getHeapEntryLink(output);
+		*index -= STRING_CHUNK_SIZE;
+	}
+	return output;
+}
+
+// Indexes are clamped like list indexes.
+static byte getStringCharacter(short pointer, short index)
+{
+	short tempLength = getHeapEntryData(pointer);
+	if (index >= tempLength)
+	{
+		index = tempLength - 1;
+	}
+	if (index < 0)
+	{
+		index = 0;
+	}
+	short tempAddress = findStringChunk(pointer, &index);
+	byte output;
+	readSramData(&output, 1, tempAddress + index);
+	return output;
+}
+
+// Returns false if the string must become a list to hold the value.
+static byte setStringCharacter(short pointer, short index, short value)
+{
+	if (index < 0)
+	{
+		index = 0;
+	}
+	if (index >= getHeapEntryData(pointer) || value == 0 || getHeapEntryType(value) != INTEGER_HEAP_ENTRY_TYPE)
+	{
+		return false;
+	}
+	short tempValue = getHeapEntryData(value);
+	if (tempValue < 0 || tempValue > 255)
+	{
+		return false;
+	}
+	byte tempCharacter = tempValue;
+	short tempAddress = findStringChunk(pointer, &index);
+	writeSramData(tempAddress + index, &tempCharacter, 1);
+	return true;
+}
+
+// Length must not be 0, because an empty list can not be a string.
+static void truncateString(short pointer, short length)
+{
+	if (length < 1)
+	{
+		length = 1;
+	}
+	if (length >= getHeapEntryData(pointer))
+	{
+		return;
+	}
+	short tempIndex = length - 1;
+	short tempAddress = findStringChunk(pointer, &tempIndex);
+	releaseStringChunks(getHeapEntryLink(tempAddress));
+	writeSramShort(tempAddress + HEAP_ENTRY_LINK_OFFSET, 0);
+	writeSramShort(pointer + HEAP_ENTRY_DATA_OFFSET, length);
+}
+
+// The first entry stays in place, so references to the string
+// refer to the list afterwards.
+static void convertStringToList(short pointer)
+{
+	short tempDataAndLink[2];
+	getHeapEntryDataAndLink(tempDataAndLink, pointer);
+	short tempLength = tempDataAndLink[0];
+	short tempFirstChunkAddress = tempDataAndLink[1];
+	short tempChunkAddress = tempFirstChunkAddress;
+	short tempPreviousPointer = pointer;
+	byte tempChunk[HEAP_ENTRY_SIZE];
+	short tempIndex = 0;
+	while (tempIndex < tempLength)
+	{
+		byte tempOffset = tempIndex % STRING_CHUNK_SIZE;
+		if (tempOffset == 0)
+		{
+			readSramData(tempChunk, HEAP_ENTRY_SIZE, tempChunkAddress);
+			tempChunkAddress = *(short *)(tempChunk + HEAP_ENTRY_LINK_OFFSET);
+		}
+		short tempPointer = allocateInteger(tempChunk[tempOffset]);
+		if (tempIndex == 0)
+		{
+			short tempEntry[HEAP_ENTRY_SIZE / 2] = {LIST_HEAP_ENTRY_TYPE, readSramShort(pointer + HEAP_ENTRY_REFERENCE_COUNT_OFFSET), tempPointer, 0};
+			writeSramData(pointer, (byte *)tempEntry, HEAP_ENTRY_SIZE);
+		} else {
+			short tempPointer2 = allocateList(tempPointer);
+			setHeapEntryLink(tempPreviousPointer, tempPointer2);
+			tempPreviousPointer = tempPointer2;
+		}
+		tempIndex += 1;
+	}
+	releaseStringChunks(tempFirstChunkAddress);
+}
+
+#endif
+
+#if ENABLE_ARRAYS
+
+// New elements hold the integer 0.
+static void fillArrayElements(short blockAddress, short startIndex, short endIndex)
+{
+	short tempPointer = allocateInteger(0);
+	openSramWriteSession(blockAddress + ARRAY_ELEMENT_LIST_OFFSET + startIndex * 2);
+	while (startIndex < endIndex)
+	{
+		writeNextSramByte(((byte *)&tempPointer)[0]);
+		writeNextSramByte(((byte *)&tempPointer)[1]);
+		startIndex += 1;
+	}
+	closeSramSession();
+}
+
+static short allocateArray(short length)
+{
+	if (length < 0)
+	{
+		length = 0;
+	}
+	short output = allocateHeapEntry(ARRAY_HEAP_ENTRY_TYPE);
+	short tempDataAndLink[2] = {length, allocateArrayBlock(length)};
+	fillArrayElements(tempDataAndLink[1], 0, length);
+	writeSramData(output + HEAP_ENTRY_DATA_OFFSET, (byte *)tempDataAndLink, 4);
+	return output;
+}
+
+// When the array grows past its capacity, the elements move to a block
+// with at least twice the capacity.
+static void setArrayLength(short pointer, short length)
+{
+	if (length < 0)
+	{
+		length = 0;
+	}
+	short tempDataAndLink[2];
+	getHeapEntryDataAndLink(tempDataAndLink, pointer);
+	short tempLength = tempDataAndLink[0];
+	short tempBlockAddress = tempDataAndLink[1];
+	if (length > tempLength)
+	{
+		short tempCapacity = readSramShort(tempBlockAddress + ARRAY_CAPACITY_OFFSET);
+		if (length > tempCapacity)
+		{
+			tempCapacity *= 2;
+			if (tempCapacity < length)
+			{
+				tempCapacity = length;
+			}
+			short tempBlockAddress2 = allocateArrayBlock(tempCapacity);
+			copySramData(tempBlockAddress2 + ARRAY_ELEMENT_LIST_OFFSET, tempBlockAddress + ARRAY_ELEMENT_LIST_OFFSET, tempLength * 2);
+			releaseArrayBlock(tempBlockAddress);
+			tempBlockAddress = tempBlockAddress2;
+		}
+		fillArrayElements(tempBlockAddress, tempLength, length);
+	} else {
+		releaseArrayElements(tempBlockAddress, length, tempLength);
+	}
+	tempDataAndLink[0] = length;
+	tempDataAndLink[1] = tempBlockAddress;
+	writeSramData(pointer + HEAP_ENTRY_DATA_OFFSET, (byte *)tempDataAndLink, 4);
+}
+
+// Returns the address of the element reference at the index.
+// Indexes are clamped like list indexes, so the array must not be empty.
+static short getArrayElementAddress(short pointer, short index)
+{
+	short tempDataAndLink[2];
+	getHeapEntryDataAndLink(tempDataAndLink, pointer);
+	if (index >= tempDataAndLink[0])
+	{
+		index = tempDataAndLink[0] - 1;
+	}
+	if (index < 0)
+	{
+		index = 0;
+	}
+	return tempDataAndLink[1] + ARRAY_ELEMENT_LIST_OFFSET + index * 2;
 }
 
+#endif
+
 static void getTextFromHeapEntry(byte *destination, short pointer)
 {
+#if ENABLE_PACKED_STRINGS
+	if (getHeapEntryType(pointer) == STRING_HEAP_ENTRY_TYPE)
+	{
+		short tempDataAndLink[2];
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		short tempLength = tempDataAndLink[0];
+		short tempAddress = tempDataAndLink[1];
+		byte tempChunk[HEAP_ENTRY_SIZE];
+		short tempIndex = 0;
+		while (tempIndex < tempLength)
+		{
+			byte tempOffset = tempIndex % STRING_CHUNK_SIZE;
+			if (tempOffset == 0)
+			{
+				readSramData(tempChunk, HEAP_ENTRY_SIZE, tempAddress);
+				tempAddress = *(short *)(tempChunk + HEAP_ENTRY_LINK_OFFSET);
+			}
+			byte tempCharacter = tempChunk[tempOffset];
+			*destination = tempCharacter;
+			if (tempCharacter == 0)
+			{
+				return;
+			}
+			destination += 1;
+			tempIndex += 1;
+		}
+		*destination = 0;
+		return;
+	}
+#endif
+#if ENABLE_ARRAYS
+	if (getHeapEntryType(pointer) == ARRAY_HEAP_ENTRY_TYPE)
+	{
+		short tempLength = getHeapEntryData(pointer);
+		short tempIndex = 0;
+		while (tempIndex < tempLength)
+		{
+			byte tempCharacter = getHeapEntryData(readSramShort(getArrayElementAddress(pointer, tempIndex)));
+			*destination = tempCharacter;
+			if (tempCharacter == 0)
+			{
+				return;
+			}
+			destination += 1;
+			tempIndex += 1;
+		}
+		*destination = 0;
+		return;
+	}
+#endif
 	while (true)
 	{
-		short tempPointer = getHeapEntryData(pointer);
-		byte tempCharacter = getHeapEntryData(tempPointer);
+		short tempDataAndLink[2];
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		byte tempCharacter = getHeapEntryData(tempDataAndLink[0]);
 		*destination = tempCharacter;
 		if (tempCharacter == 0)
 		{
 			break;
 		}
-		pointer = getHeapEntryLink(pointer);
+		pointer = tempDataAndLink[1];
 		destination += 1;
 	}
 }
@@ -1254,74 +3009,215 @@ static void getTextFromHeapEntry(byte *destination, short pointer)
 // Use this function for automatic heap maintainence.
 static void setHeapEntryReference(short referenceAddress, short reference)
 {
-	short tempOldReference = readSramShort(referenceAddress);
-	if (tempOldReference != EMPTY_HEAP_ENTRY_TYPE)
+	short tempOldReference = readReference(referenceAddress);
+	if (tempOldReference != EMPTY_HEAP_ENTRY_TYPE && !isTaggedInteger(tempOldReference))
 	{
 		changeHeapEntryReferenceCount(tempOldReference, -1);
 	}
-	writeSramShort(referenceAddress, reference);
-	if (reference != EMPTY_HEAP_ENTRY_TYPE)
+	writeReference(referenceAddress, reference);
+	if (reference != EMPTY_HEAP_ENTRY_TYPE && !isTaggedInteger(reference))
 	{
 		changeHeapEntryReferenceCount(reference, 1);
 	}
 }
 
-static short convertEepromTextToInt(long address, short *tempOffset)
+#if ENABLE_CONSTANT_TABLE
+
+static byte isConstant(short pointer)
+{
+	if (pointer == 0 || isTaggedInteger(pointer))
+	{
+		return false;
+	}
+	return readSramShort(pointer + HEAP_ENTRY_REFERENCE_COUNT_OFFSET) >= CONSTANT_REFERENCE_COUNT;
+}
+
+// Marks the entry and everything which it refers to as constant.
+static void markConstant(short pointer)
+{
+	while (pointer && !isTaggedInteger(pointer))
+	{
+		short tempType = getHeapEntryType(pointer);
+		writeSramShort(pointer + HEAP_ENTRY_REFERENCE_COUNT_OFFSET, CONSTANT_REFERENCE_COUNT);
+		if (tempType != LIST_HEAP_ENTRY_TYPE)
+		{
+			return;
+		}
+		short tempDataAndLink[2];
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		markConstant(tempDataAndLink[0]);
+		pointer = tempDataAndLink[1];
+	}
+}
+
+#endif
+
+#if ENABLE_CONSTANT_TABLE || ENABLE_BULK_LIST_FUNCTIONS
+
+static short copyConstant(short pointer);
+
+// Returns a new copy of the entry. The elements of a list or an array
+// are shared with the copy unless they are constants.
+static short copyHeapEntry(short pointer)
+{
+	if (pointer == 0 || isTaggedInteger(pointer))
+	{
+		return pointer;
+	}
+	short tempType = getHeapEntryType(pointer);
+	if (tempType == INTEGER_HEAP_ENTRY_TYPE)
+	{
+		return allocateInteger(getHeapEntryData(pointer));
+	}
+#if ENABLE_PACKED_STRINGS
+	if (tempType == STRING_HEAP_ENTRY_TYPE)
+	{
+		short tempDataAndLink[2];
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		short output = allocateHeapEntry(STRING_HEAP_ENTRY_TYPE);
+		short tempPreviousAddress = output;
+		short tempAddress = tempDataAndLink[1];
+		while (tempAddress)
+		{
+			byte tempChunk[HEAP_ENTRY_SIZE];
+			readSramData(tempChunk, HEAP_ENTRY_SIZE, tempAddress);
+			tempAddress = *(short *)(tempChunk + HEAP_ENTRY_LINK_OFFSET);
+			tempPreviousAddress = appendStringChunk(tempPreviousAddress, tempChunk);
+		}
+		writeSramShort(output + HEAP_ENTRY_DATA_OFFSET, tempDataAndLink[0]);
+		return output;
+	}
+#endif
+#if ENABLE_ARRAYS
+	if (tempType == ARRAY_HEAP_ENTRY_TYPE)
+	{
+		short tempLength = getHeapEntryData(pointer);
+		short output = allocateArray(tempLength);
+		short tempAddress = getArrayElementAddress(pointer, 0);
+		short tempAddress2 = getArrayElementAddress(output, 0);
+		while (tempLength > 0)
+		{
+			setHeapEntryReference(tempAddress2, copyConstant(readSramShort(tempAddress)));
+			tempAddress += 2;
+			tempAddress2 += 2;
+			tempLength -= 1;
+		}
+		return output;
+	}
+#endif
+	short output = 0;
+	short tempPreviousPointer = 0;
+	while (pointer)
+	{
+		short tempDataAndLink[2];
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		short tempPointer = allocateList(copyConstant(tempDataAndLink[0]));
+		if (tempPreviousPointer == 0)
+		{
+			output = tempPointer;
+		} else {
+			setHeapEntryLink(tempPreviousPointer, tempPointer);
+		}
+		tempPreviousPointer = tempPointer;
+		pointer = tempDataAndLink[1];
+	}
+	return output;
+}
+
+#endif
+
+// Returns a new copy of a constant, or the pointer itself if it is not a constant.
+static short copyConstant(short pointer)
+{
+#if ENABLE_CONSTANT_TABLE
+	if (!isConstant(pointer))
+	{
+		return pointer;
+	}
+	return copyHeapEntry(pointer);
+#else
+	return pointer;
+#endif
+}
+
+// Reads from the program reader.
+static short convertEepromTextToInt()
 {
 	byte tempBuffer[20];
 	byte index = 0;
 	while (true)
 	{
-		byte tempCharacter = readEepromByte(address + *tempOffset);
+		byte tempCharacter = peekProgramByte();
 		if ((tempCharacter < '0' || tempCharacter > '9') && tempCharacter != '-')
 		{
 			tempBuffer[index] = 0;
 			break;
 		}
 		tempBuffer[index] = tempCharacter;
-		*tempOffset += 1;
+		programReaderAddress += 1;
 		index += 1;
 	}
 	return atoi((char *)tempBuffer);
 }
 
-// Returns a new commandOffset.
-static short parseArgumentTerm(short commandOffset, byte argumentIndex)
+static void setLiteralArgument(byte argumentIndex, short pointer)
 {
-	byte tempCharacter = readEepromByte(commandAddress + commandOffset);
+	byte tempIndex = argumentPointerAddressList - argumentPointerAddressBuffer + argumentIndex;
+	short tempPointerAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + tempIndex * 2;
+	setHeapEntryReference(tempPointerAddress, pointer);
+	argumentPointerAddressList[argumentIndex] = tempPointerAddress;
+}
+
+static void stopWithError(const byte *message);
+#if ENABLE_NESTED_EXPRESSIONS
+static void parseExpression(byte argumentIndex);
+#endif
+
+// Reads from the program reader.
+static void parseArgumentTerm(byte argumentIndex)
+{
+	byte tempCharacter = peekProgramByte();
 	if ((tempCharacter >= '0' && tempCharacter <= '9') || tempCharacter == '-')
 	{
-		short tempNumber = convertEepromTextToInt(commandAddress, &commandOffset);
-		short tempPointer = allocateInteger(tempNumber);
-		short tempPointerAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + argumentIndex * 2;
-		setHeapEntryReference(tempPointerAddress, tempPointer);
-		argumentPointerAddressList[argumentIndex] = tempPointerAddress;
+		short tempNumber = convertEepromTextToInt();
+		setLiteralArgument(argumentIndex, allocateInteger(tempNumber));
 	}
 	if (tempCharacter >= 'A' && tempCharacter <= 'Z')
 	{
-		commandOffset += 1;
+		programReaderAddress += 1;
 		short tempPointerAddress = scopeAddress + SCOPE_VARIABLE_LIST_OFFSET + (tempCharacter - 'A') * 2;
 		argumentPointerAddressList[argumentIndex] = tempPointerAddress;
+#if ENABLE_CONSTANT_TABLE
+		hasNonConstantTerm = true;
+#endif
 	}
 	if (tempCharacter == '(')
 	{
 		short tempStartPointer = 0;
 		short tempPointer = 0;
-		commandOffset += 1;
+		programReaderAddress += 1;
 		while (true)
 		{
-			byte tempCharacter = readEepromByte(commandAddress + commandOffset);
+			byte tempCharacter = peekProgramByte();
 			if (tempCharacter == ')')
 			{
+				programReaderAddress += 1;
 				break;
 			}
 			if (tempCharacter == ' ')
 			{
-				commandOffset += 1;
+				programReaderAddress += 1;
+				continue;
+			}
+			int32_t tempAddress = programReaderAddress;
+			parseArgumentTerm(argumentIndex);
+			if (programReaderAddress == tempAddress || hasStoppedExecution)
+			{
+				// The list is not closed, or an element is not valid.
+				break;
 			}
-			commandOffset = parseArgumentTerm(commandOffset, argumentIndex);
 			short tempPointerAddress = argumentPointerAddressList[argumentIndex];
-			short tempPointer2 = readSramShort(tempPointerAddress);
+			short tempPointer2 = readReference(tempPointerAddress);
 			short tempPointer3 = allocateList(tempPointer2);
 			if (tempPointer == 0)
 			{
@@ -1335,47 +3231,209 @@ static short parseArgumentTerm(short commandOffset, byte argumentIndex)
 		{
 			tempStartPointer = allocateList(0);
 		}
-		short tempPointerAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + argumentIndex * 2;
-		setHeapEntryReference(tempPointerAddress, tempStartPointer);
-		argumentPointerAddressList[argumentIndex] = tempPointerAddress;
+		setLiteralArgument(argumentIndex, tempStartPointer);
 	}
 	if (tempCharacter == '"')
 	{
-		short tempStartPointer = 0;
-		short tempPointer = 0;
-		commandOffset += 1;
-		while (true)
-		{
-			byte tempCharacter = readEepromByte(commandAddress + commandOffset);
-			commandOffset += 1;
-			if (tempCharacter == '"')
-			{
-				tempCharacter = 0;
-			}
-			short tempPointer2 = allocateInteger(tempCharacter);
-			short tempPointer3 = allocateList(tempPointer2);
-			if (tempPointer == 0)
-			{
-				tempStartPointer = tempPointer3;
-			} else {
-				setHeapEntryLink(tempPointer, tempPointer3);
-			}
-			tempPointer = tempPointer3;
-			if (tempCharacter == 0)
-			{
-				break;
-			}
+		programReaderAddress += 1;
+		setLiteralArgument(argumentIndex, allocateText(0));
+	}
+	if (tempCharacter == '[')
+	{
+#if ENABLE_NESTED_EXPRESSIONS
+		parseExpression(argumentIndex);
+#else
+		stopWithError(MESSAGE_10);
+#endif
+	}
+}
+
+#if ENABLE_CONSTANT_TABLE
+
+static void clearConstantTable()
+{
+	fillSramData(CONSTANT_TABLE_ADDRESS, 0xFF, CONSTANT_TABLE_SIZE * CONSTANT_TABLE_ENTRY_SIZE);
+}
+
+// Reads the entry of the literal at the address, or the empty entry where
+// it belongs, into the destination. Returns the address of the entry,
+// or -1 if the table is full.
+static short findConstantTableEntry(byte *destination, int32_t address)
+{
+	byte tempSlot = address % CONSTANT_TABLE_SIZE;
+	byte tempCount = 0;
+	while (tempCount < CONSTANT_TABLE_SIZE)
+	{
+		short tempEntryAddress = CONSTANT_TABLE_ADDRESS + tempSlot * CONSTANT_TABLE_ENTRY_SIZE;
+		readSramData(destination, CONSTANT_TABLE_ENTRY_SIZE, tempEntryAddress);
+		int32_t tempAddress = *(int32_t *)destination;
+		if (tempAddress == address || tempAddress == EMPTY_CONSTANT_TABLE_ENTRY)
+		{
+			return tempEntryAddress;
 		}
-		short tempPointerAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + argumentIndex * 2;
-		setHeapEntryReference(tempPointerAddress, tempStartPointer);
-		argumentPointerAddressList[argumentIndex] = tempPointerAddress;
+		tempSlot = (tempSlot + 1) % CONSTANT_TABLE_SIZE;
+		tempCount += 1;
+	}
+	return -1;
+}
+
+#endif
+
+// Reads from the program reader. Lists, text and integers which need a heap
+// entry are only built the first time they run. Afterwards the argument
+// refers to the constant and the reader skips over the literal.
+static void parseArgument(byte argumentIndex)
+{
+#if ENABLE_CONSTANT_TABLE
+	int32_t tempAddress = programReaderAddress;
+	byte tempCharacter = peekProgramByte();
+	byte tempIsInteger = ((tempCharacter >= '0' && tempCharacter <= '9') || tempCharacter == '-');
+	short tempNumber = 0;
+	if (tempIsInteger)
+	{
+		tempNumber = convertEepromTextToInt();
+#if ENABLE_TAGGED_INTEGERS
+		if (tempNumber >= MINIMUM_TAGGED_INTEGER && tempNumber <= MAXIMUM_TAGGED_INTEGER)
+		{
+			setLiteralArgument(argumentIndex, allocateInteger(tempNumber));
+			return;
+		}
+#endif
+	} else if (tempCharacter != '(' && tempCharacter != '"')
+	{
+		parseArgumentTerm(argumentIndex);
+		return;
+	}
+	byte tempEntry[CONSTANT_TABLE_ENTRY_SIZE];
+	short tempEntryAddress = findConstantTableEntry(tempEntry, tempAddress);
+	if (tempEntryAddress >= 0 && *(int32_t *)tempEntry == tempAddress)
+	{
+		programReaderAddress = tempAddress + *(short *)(tempEntry + CONSTANT_TABLE_LENGTH_OFFSET);
+		setLiteralArgument(argumentIndex, *(short *)(tempEntry + CONSTANT_TABLE_POINTER_OFFSET));
+		return;
+	}
+	hasNonConstantTerm = false;
+	if (tempIsInteger)
+	{
+		setLiteralArgument(argumentIndex, allocateInteger(tempNumber));
+	} else {
+		parseArgumentTerm(argumentIndex);
+	}
+	if (tempEntryAddress >= 0 && !hasNonConstantTerm)
+	{
+		short tempPointer = readSramShort(argumentPointerAddressList[argumentIndex]);
+		markConstant(tempPointer);
+		*(int32_t *)tempEntry = tempAddress;
+		*(short *)(tempEntry + CONSTANT_TABLE_POINTER_OFFSET) = tempPointer;
+		*(short *)(tempEntry + CONSTANT_TABLE_LENGTH_OFFSET) = programReaderAddress - tempAddress;
+		writeSramData(tempEntryAddress, tempEntry, CONSTANT_TABLE_ENTRY_SIZE);
 	}
-	return commandOffset;
+#else
+	parseArgumentTerm(argumentIndex);
+#endif
 }
 
+static void readProgramWord(byte *destination);
+static void executeBuiltInFunction(byte command, byte numberOfArguments);
+
+// Shows the message and stops the program once a button is pressed.
+static void stopWithError(const byte *message)
+{
+	displayProgmemText(message);
+#if ENABLE_PROFILER
+	pauseProfiling();
+#endif
+	promptButton();
+#if ENABLE_PROFILER
+	resumeProfiling();
+#endif
+	hasStoppedExecution = true;
+}
+
+#if ENABLE_NESTED_EXPRESSIONS
+
+// Returns whether the built-in function stores a result in its
+// first argument, so that a nested expression can run it.
+static byte hasBuiltInFunctionResult(byte command)
+{
+	if (command >= NUMBER_OF_BUILT_IN_FUNCTIONS || (command >= FIRST_FLOW_CONTROL_FUNCTION && command <= LAST_FLOW_CONTROL_FUNCTION))
+	{
+		return false;
+	}
+	byte index = 0;
+	while (index < sizeof(NO_RESULT_FUNCTION_LIST))
+	{
+		if (pgm_read_byte(NO_RESULT_FUNCTION_LIST + index) == command)
+		{
+			return false;
+		}
+		index += 1;
+	}
+	return true;
+}
+
+// Runs a nested expression such as [* A B], which is a built-in function
+// without its destination. Its arguments take the places after this one,
+// and its result becomes this argument.
+static void parseExpression(byte argumentIndex)
+{
+	byte tempCommandName[COMMAND_NAME_BUFFER_SIZE];
+	programReaderAddress += 1;
+	readProgramWord(tempCommandName);
+	byte tempCommand = findBuiltInFunction(tempCommandName);
+	short *tempArgumentPointerAddressList = argumentPointerAddressList;
+	argumentPointerAddressList += argumentIndex;
+	setLiteralArgument(0, allocateInteger(0));
+	byte tempArgumentIndex = 1;
+	while (peekProgramByte() == ' ' && !hasStoppedExecution)
+	{
+		// The arguments of all nested expressions share one buffer.
+		if (argumentPointerAddressList - argumentPointerAddressBuffer + tempArgumentIndex >= MAXIMUM_NUMBER_OF_ARGUMENTS)
+		{
+			stopWithError(MESSAGE_13);
+			break;
+		}
+		programReaderAddress += 1;
+		parseArgument(tempArgumentIndex);
+		tempArgumentIndex += 1;
+	}
+	// An error in an inner expression has already been shown.
+	if (!hasStoppedExecution)
+	{
+		if (peekProgramByte() == ']' && hasBuiltInFunctionResult(tempCommand))
+		{
+			// Skip the closing bracket.
+			programReaderAddress += 1;
+			executeBuiltInFunction(tempCommand, tempArgumentIndex);
+		} else {
+			// Too many arguments, a missing bracket, or a function
+			// without a result such as flow control or a custom function.
+			stopWithError(MESSAGE_10);
+		}
+	}
+	argumentPointerAddressList = tempArgumentPointerAddressList;
+#if ENABLE_CONSTANT_TABLE
+	hasNonConstantTerm = true;
+#endif
+}
+
+#endif
+
 static short getArgumentPointer(byte index)
 {
-	return readSramShort(argumentPointerAddressList[index]);
+	return readReference(argumentPointerAddressList[index]);
+}
+
+// Replaces a constant argument with a copy, so that it can be changed.
+static short getMutableArgumentPointer(byte index)
+{
+	short tempPointer = getArgumentPointer(index);
+	short output = copyConstant(tempPointer);
+	if (output != tempPointer)
+	{
+		setHeapEntryReference(argumentPointerAddressList[index], output);
+	}
+	return output;
 }
 
 static short getArgumentInteger(byte index)
@@ -1395,59 +3453,846 @@ static void changeFlowDataAddress(short offset)
 	writeSramShort(scopeAddress + SCOPE_SIZE_OFFSET, tempSize);
 }
 
-static void __attribute__ ((noinline)) executeNextCommand()
+// Reads a command name from the program reader. Stops before the
+// space, newline or null character which ends it.
+static void readProgramWord(byte *destination)
+{
+	byte tempLength = 0;
+	while (tempLength < COMMAND_NAME_BUFFER_SIZE - 1)
+	{
+		byte tempCharacter = peekProgramByte();
+		if (tempCharacter == 0 || tempCharacter == ' ' || tempCharacter == '\n' || tempCharacter == ']')
+		{
+			break;
+		}
+		destination[tempLength] = tempCharacter;
+		programReaderAddress += 1;
+		tempLength += 1;
+	}
+	destination[tempLength] = 0;
+}
+
+#if ENABLE_FILE_NAME_TABLE
+
+static byte hashFileName(byte *name)
+{
+	byte output = 0;
+	while (*name != 0)
+	{
+		output = output * 31 + *name;
+		name += 1;
+	}
+	return output % FILE_NAME_TABLE_SIZE;
+}
+
+// Must be called before running a program.
+static void buildFileNameTable()
+{
+	fillSramData(FILE_NAME_TABLE_ADDRESS, EMPTY_FILE_NAME_TABLE_ENTRY, FILE_NAME_TABLE_SIZE * FILE_NAME_TABLE_ENTRY_SIZE);
+	byte tempFileIndex = 0;
+	while (tempFileIndex < NUMBER_OF_FILE_ENTRY_POSITIONS)
+	{
+		byte tempEntry[FILE_NAME_TABLE_ENTRY_SIZE];
+		getFileName(tempEntry, tempFileIndex);
+		if (tempEntry[0] != EMPTY_FILE_ENTRY_INDICATOR)
+		{
+			// Files are added in order, so the first file with a name
+			// comes first in its probe sequence.
+			tempEntry[FILE_NAME_TABLE_INDEX_OFFSET] = tempFileIndex;
+			byte tempSlot = hashFileName(tempEntry);
+			while (true)
+			{
+				short tempAddress = FILE_NAME_TABLE_ADDRESS + tempSlot * FILE_NAME_TABLE_ENTRY_SIZE;
+				byte tempIndex;
+				readSramData(&tempIndex, 1, tempAddress + FILE_NAME_TABLE_INDEX_OFFSET);
+				if (tempIndex == EMPTY_FILE_NAME_TABLE_ENTRY)
+				{
+					writeSramData(tempAddress, tempEntry, FILE_NAME_TABLE_ENTRY_SIZE);
+					break;
+				}
+				tempSlot = (tempSlot + 1) % FILE_NAME_TABLE_SIZE;
+			}
+		}
+		tempFileIndex += 1;
+	}
+}
+
+// Returns 255 if there is no file with the name.
+static byte findFileByName(byte *name)
+{
+	byte tempSlot = hashFileName(name);
+	while (true)
+	{
+		byte tempEntry[FILE_NAME_TABLE_ENTRY_SIZE];
+		readSramData(tempEntry, FILE_NAME_TABLE_ENTRY_SIZE, FILE_NAME_TABLE_ADDRESS + tempSlot * FILE_NAME_TABLE_ENTRY_SIZE);
+		byte tempIndex = tempEntry[FILE_NAME_TABLE_INDEX_OFFSET];
+		if (tempIndex == EMPTY_FILE_NAME_TABLE_ENTRY)
+		{
+			return 255;
+		}
+		if (equalText(tempEntry, name))
+		{
+			return tempIndex;
+		}
+		tempSlot = (tempSlot + 1) % FILE_NAME_TABLE_SIZE;
+	}
+}
+
+#else
+
+// Returns 255 if there is no file with the name.
+static byte findFileByName(byte *name)
+{
+	byte tempFileIndex = 0;
+	while (tempFileIndex < NUMBER_OF_FILE_ENTRY_POSITIONS)
+	{
+		byte tempBuffer[MAXIMUM_FILE_NAME_LENGTH + 1];
+		getFileName(tempBuffer, tempFileIndex);
+		if (tempBuffer[0] != EMPTY_FILE_ENTRY_INDICATOR && equalText(tempBuffer, name))
+		{
+			return tempFileIndex;
+		}
+		tempFileIndex += 1;
+	}
+	return 255;
+}
+
+#endif
+
+static void releaseLiteralArguments()
 {
-	
-	long tempNextCommandAddress;
 	short tempOffset = 0;
 	while (tempOffset < LITERAL_ARGUMENT_ADDRESS_LIST_SIZE)
 	{
 		short tempAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + tempOffset;
-		writeSramShort(tempAddress, 0);
+		setHeapEntryReference(tempAddress, 0);
 		tempOffset += 2;
 	}
-	byte shouldQuitFile = false;
-	byte tempCommandName[30];
-	tempOffset = 0;
+}
+
+static void enterFunctionScope(int32_t returnAddress, byte numberOfArguments)
+{
+#if ENABLE_SCOPE_VARIABLE_CACHE
+	saveScopeVariables();
+#endif
+	short tempNextScopeAddress = scopeAddress + readSramShort(scopeAddress + SCOPE_SIZE_OFFSET);
+#if ENABLE_SCOPE_VARIABLE_CACHE
+	// Builds with the cache have the flash to write the header in one transaction.
+	byte tempHeader[SCOPE_HEADER_SIZE];
+	*(int32_t *)(tempHeader + SCOPE_RETURN_ADDRESS_OFFSET) = returnAddress;
+	*(short *)(tempHeader + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET) = scopeAddress;
+	*(short *)(tempHeader + SCOPE_SIZE_OFFSET) = SCOPE_FLOW_DATA_OFFSET;
+	writeSramData(tempNextScopeAddress, tempHeader, SCOPE_HEADER_SIZE);
+#else
+	writeSramLong(tempNextScopeAddress + SCOPE_RETURN_ADDRESS_OFFSET, returnAddress);
+	writeSramShort(tempNextScopeAddress + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET, scopeAddress);
+	writeSramShort(tempNextScopeAddress + SCOPE_SIZE_OFFSET, SCOPE_FLOW_DATA_OFFSET);
+#endif
+	scopeAddress = tempNextScopeAddress;
+	initializeScopeVariables();
+	byte tempIndex = 0;
+	while (tempIndex < numberOfArguments)
+	{
+		short tempPointer = copyConstant(getArgumentPointer(tempIndex));
+		setHeapEntryReference(tempNextScopeAddress + SCOPE_VARIABLE_LIST_OFFSET + tempIndex * 2, tempPointer);
+		tempIndex += 1;
+	}
+}
+
+// Returns the address of the next command. Execution stops when
+// the outermost file quits.
+static int32_t quitFunctionScope(int32_t nextCommandAddress)
+{
+	if (scopeAddress <= STACK_OFFSET)
+	{
+		hasStoppedExecution = true;
+		return nextCommandAddress;
+	}
+#if ENABLE_SCOPE_VARIABLE_CACHE
+	// Only variables which were assigned can hold references.
+	byte tempIndex = 0;
+	while (scopeVariableMask)
+	{
+		if (scopeVariableMask & 1)
+		{
+			short tempPointer = scopeVariableList[tempIndex];
+			if (tempPointer != 0 && !isTaggedInteger(tempPointer))
+			{
+				changeHeapEntryReferenceCount(tempPointer, -1);
+			}
+		}
+		scopeVariableMask >>= 1;
+		tempIndex += 1;
+	}
+#else
+	byte tempIndex = 0;
+	while (tempIndex < NUMBER_OF_SCOPE_VARIABLES)
+	{
+		setHeapEntryReference(scopeAddress + SCOPE_VARIABLE_LIST_OFFSET + tempIndex * 2, 0);
+		tempIndex += 1;
+	}
+#endif
+#if ENABLE_SCOPE_VARIABLE_CACHE
+	byte tempHeader[SCOPE_HEADER_SIZE];
+	readSramData(tempHeader, SCOPE_HEADER_SIZE, scopeAddress);
+	int32_t output = *(int32_t *)(tempHeader + SCOPE_RETURN_ADDRESS_OFFSET);
+	scopeAddress = *(short *)(tempHeader + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET);
+	loadScopeVariables();
+#else
+	int32_t output = readSramLong(scopeAddress + SCOPE_RETURN_ADDRESS_OFFSET);
+	scopeAddress = readSramShort(scopeAddress + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET);
+#endif
+	return output;
+}
+
+#if ENABLE_BLOCK_TABLE
+
+static void clearBlockTable()
+{
+	fillSramData(BLOCK_TABLE_ADDRESS, 0xFF, BLOCK_TABLE_SIZE * BLOCK_TABLE_ENTRY_SIZE);
+	blockTableEntryCount = 0;
+}
+
+// Returns -1 if the block has not been skipped yet.
+static int32_t getBlockEndAddress(int32_t address)
+{
+	byte tempSlot = address % BLOCK_TABLE_SIZE;
 	while (true)
 	{
-		byte tempCharacter = readEepromByte(commandAddress + tempOffset);
-		if (tempCharacter == 0)
+		int32_t tempEntry[2];
+		readSramData((byte *)tempEntry, BLOCK_TABLE_ENTRY_SIZE, BLOCK_TABLE_ADDRESS + tempSlot * BLOCK_TABLE_ENTRY_SIZE);
+		if (tempEntry[0] == address)
 		{
-			shouldQuitFile = true;
-			break;
+			return tempEntry[1];
+		}
+		if (tempEntry[0] == EMPTY_BLOCK_TABLE_ENTRY)
+		{
+			return -1;
 		}
-		if (tempCharacter == ' ' || tempCharacter == '\n')
+		tempSlot = (tempSlot + 1) % BLOCK_TABLE_SIZE;
+	}
+}
+
+// Blocks are not remembered once the table is full.
+static void setBlockEndAddress(int32_t address, int32_t endAddress)
+{
+	if (blockTableEntryCount >= MAXIMUM_BLOCK_TABLE_ENTRY_COUNT)
+	{
+		return;
+	}
+	byte tempSlot = address % BLOCK_TABLE_SIZE;
+	while (true)
+	{
+		short tempEntryAddress = BLOCK_TABLE_ADDRESS + tempSlot * BLOCK_TABLE_ENTRY_SIZE;
+		if (readSramLong(tempEntryAddress) == EMPTY_BLOCK_TABLE_ENTRY)
+		{
+			int32_t tempEntry[2] = {address, endAddress};
+			writeSramData(tempEntryAddress, (byte *)tempEntry, BLOCK_TABLE_ENTRY_SIZE);
+			blockTableEntryCount += 1;
+			return;
+		}
+		tempSlot = (tempSlot + 1) % BLOCK_TABLE_SIZE;
+	}
+}
+
+#else
+
+// Without the table, no block end is known in advance.
+static int32_t getBlockEndAddress(int32_t address)
+{
+	return -1;
+}
+
+#endif
+
+static void startIgnoringCommands()
+{
+	isIgnoringCommands = true;
+#if ENABLE_BLOCK_TABLE
+	ignoredBlockAddress = commandAddress;
+#endif
+}
+
+#if ENABLE_BULK_LIST_FUNCTIONS
+
+// Sets the first elements of the list to the value, and appends elements
+// if the list is shorter than the count. The count must be positive.
+static void fillListElements(short pointer, short count, short value)
+{
+	while (true)
+	{
+		setHeapEntryData(pointer, value);
+		count -= 1;
+		if (count <= 0)
 		{
 			break;
 		}
-		tempCommandName[tempOffset] = tempCharacter;
-		tempOffset += 1;
+		short tempPointer = getHeapEntryLink(pointer);
+		if (tempPointer == 0)
+		{
+			tempPointer = allocateList(0);
+			setHeapEntryLink(pointer, tempPointer);
+		}
+		pointer = tempPointer;
+	}
+}
+
+#endif
+
+#if ENABLE_BULK_LIST_FUNCTIONS
+
+// Walks the elements of a list or an array once. Returns the index of
+// the first integer element which is equal to value when finding,
+// or otherwise the sum of the integer elements.
+static short scanIntegerElements(short pointer, byte shouldFind, short value)
+{
+	short output = 0;
+	short tempType = 0;
+	if (pointer != 0)
+	{
+		tempType = getHeapEntryType(pointer);
+	}
+	short tempLength = 0x7FFF;
+	short tempDataAndLink[2];
+#if ENABLE_ARRAYS
+	short tempAddress = 0;
+	if (tempType == ARRAY_HEAP_ENTRY_TYPE)
+	{
+		getHeapEntryDataAndLink(tempDataAndLink, pointer);
+		tempLength = tempDataAndLink[0];
+		tempAddress = tempDataAndLink[1] + ARRAY_ELEMENT_LIST_OFFSET;
+	} else
+#endif
+	if (tempType != LIST_HEAP_ENTRY_TYPE)
+	{
+		tempLength = 0;
+	}
+	short tempIndex = 0;
+	while (tempIndex < tempLength && pointer != 0)
+	{
+		short tempElement;
+#if ENABLE_ARRAYS
+		if (tempType == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			tempElement = readSramShort(tempAddress);
+			tempAddress += 2;
+		} else
+#endif
+		{
+			getHeapEntryDataAndLink(tempDataAndLink, pointer);
+			tempElement = tempDataAndLink[0];
+			pointer = tempDataAndLink[1];
+		}
+		if (tempElement != 0 && getHeapEntryType(tempElement) == INTEGER_HEAP_ENTRY_TYPE)
+		{
+			short tempValue = getHeapEntryData(tempElement);
+			if (!shouldFind)
+			{
+				output += tempValue;
+			} else if (tempValue == value)
+			{
+				return tempIndex;
+			}
+		}
+		tempIndex += 1;
+	}
+	if (shouldFind)
+	{
+		return -1;
+	}
+	return output;
+}
+
+// Reference counts stay the same, because every entry still holds the
+// same element and every entry after the head is still linked once.
+static void reverseElements(short pointer)
+{
+	short tempDataAndLink[2];
+	getHeapEntryDataAndLink(tempDataAndLink, pointer);
+#if ENABLE_ARRAYS
+	if (getHeapEntryType(pointer) == ARRAY_HEAP_ENTRY_TYPE)
+	{
+		short tempAddress = tempDataAndLink[1] + ARRAY_ELEMENT_LIST_OFFSET;
+		short tempAddress2 = tempAddress + (tempDataAndLink[0] - 1) * 2;
+		while (tempAddress < tempAddress2)
+		{
+			short tempElement = readSramShort(tempAddress);
+			writeSramShort(tempAddress, readSramShort(tempAddress2));
+			writeSramShort(tempAddress2, tempElement);
+			tempAddress += 2;
+			tempAddress2 -= 2;
+		}
+		return;
+	}
+#endif
+	short tempSecondPointer = tempDataAndLink[1];
+	if (tempSecondPointer == 0)
+	{
+		return;
+	}
+	short tempPreviousPointer = 0;
+	short tempPointer = pointer;
+	while (tempPointer != 0)
+	{
+		short tempNextPointer = getHeapEntryLink(tempPointer);
+		writeSramShort(tempPointer + HEAP_ENTRY_LINK_OFFSET, tempPreviousPointer);
+		tempPreviousPointer = tempPointer;
+		tempPointer = tempNextPointer;
+	}
+	// Variables refer to the head, so the head trades places with the
+	// entry which now leads the chain.
+	short tempLastPointer = tempPreviousPointer;
+	getHeapEntryDataAndLink(tempDataAndLink, tempLastPointer);
+	if (tempDataAndLink[1] == pointer)
+	{
+		tempDataAndLink[1] = tempLastPointer;
+	}
+	writeSramShort(tempLastPointer + HEAP_ENTRY_DATA_OFFSET, getHeapEntryData(pointer));
+	writeSramData(pointer + HEAP_ENTRY_DATA_OFFSET, (byte *)tempDataAndLink, 4);
+	writeSramShort(tempSecondPointer + HEAP_ENTRY_LINK_OFFSET, tempLastPointer);
+	writeSramShort(tempLastPointer + HEAP_ENTRY_LINK_OFFSET, 0);
+}
+
+#endif
+
+// Runs every built-in function except for flow control.
+static void executeBuiltInFunction(byte command, byte numberOfArguments)
+{
+	short tempValue1 = 0;
+	short tempValue2 = 0;
+	if (numberOfArguments > 1)
+	{
+		tempValue1 = getArgumentInteger(1);
+		if (numberOfArguments > 2)
+		{
+			tempValue2 = getArgumentInteger(2);
+		}
+	}
+	if (command == 0)
+	{
+		// =.
+		setHeapEntryReference(argumentPointerAddressList[0], copyConstant(getArgumentPointer(1)));
+	} else if (command == 1)
+	{
+		// +.
+		short tempResult = tempValue1 + tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 2)
+	{
+		// -.
+		short tempResult = tempValue1 - tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 3)
+	{
+		// *.
+		short tempResult = tempValue1 * tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 4)
+	{
+		// /.
+		short tempResult = tempValue1 / tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 5)
+	{
+		// %.
+		short tempResult = tempValue1 % tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 6)
+	{
+		// ==.
+		short tempResult = tempValue1 == tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 7)
+	{
+		// >.
+		short tempResult = tempValue1 > tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 8)
+	{
+		// !.
+		short tempResult = !tempValue1;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 9)
+	{
+		// ~.
+		short tempResult = ~tempValue1;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 10)
+	{
+		// |.
+		short tempResult = tempValue1 | tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 11)
+	{
+		// &.
+		short tempResult = tempValue1 & tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 12)
+	{
+		// <<.
+		short tempResult = tempValue1 << tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 13)
+	{
+		// >>.
+		short tempResult = tempValue1 >> tempValue2;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 19)
+	{
+		// RAND.
+		short tempValue = getArgumentInteger(1);
+		short tempResult = generateRandomNumber() % tempValue;
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 20)
+	{
+		// STR.
+		short tempValue = getArgumentInteger(1);
+		byte tempBuffer[20];
+		itoa(tempValue, (char *)tempBuffer, 10);
+		short tempPointer = allocateText(tempBuffer);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 21)
+	{
+		// INT.
+		byte tempBuffer[40];
+		short tempPointer = getArgumentPointer(1);
+		getTextFromHeapEntry(tempBuffer, tempPointer);
+		short tempResult = atoi((char *)tempBuffer);
+		tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 22)
+	{
+		// LEN.
+		short tempResult = 0;
+		short tempPointer = getArgumentPointer(1);
+		short tempType = getHeapEntryType(tempPointer);
+		if (tempType == STRING_HEAP_ENTRY_TYPE || tempType == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			tempResult = getHeapEntryData(tempPointer);
+		} else {
+			while (true)
+			{
+				short tempDataAndLink[2];
+				getHeapEntryDataAndLink(tempDataAndLink, tempPointer);
+				if (tempDataAndLink[0] == 0)
+				{
+					break;
+				}
+				tempResult += 1;
+				tempPointer = tempDataAndLink[1];
+				if (tempPointer == 0)
+				{
+					break;
+				}
+			}
+		}
+		tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 23)
+	{
+		// TRUNC.
+		short tempPointer = getMutableArgumentPointer(0);
+		short tempTargetLength = getArgumentInteger(1);
+#if ENABLE_ARRAYS
+		if (getHeapEntryType(tempPointer) == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			setArrayLength(tempPointer, tempTargetLength);
+			return;
+		}
+#endif
+#if ENABLE_PACKED_STRINGS
+		if (getHeapEntryType(tempPointer) == STRING_HEAP_ENTRY_TYPE)
+		{
+			if (tempTargetLength != 0)
+			{
+				truncateString(tempPointer, tempTargetLength);
+				return;
+			}
+			convertStringToList(tempPointer);
+		}
+#endif
+		short tempIndex = 0;
+		while (tempIndex < tempTargetLength - 1)
+		{
+			short tempPointer2 = getHeapEntryData(tempPointer);
+			if (tempPointer2 == 0)
+			{
+				break;
+			}
+			tempPointer2 = getHeapEntryLink(tempPointer);
+			if (tempPointer2 == 0)
+			{
+				break;
+			}
+			tempPointer = tempPointer2;
+			tempIndex += 1;
+		}
+		if (tempTargetLength == 0)
+		{
+			setHeapEntryData(tempPointer, 0);
+		}
+		setHeapEntryLink(tempPointer, 0);
+	} else if (command == 24)
+	{
+		// GET.
+		short tempPointer = getArgumentPointer(1);
+		short tempEndIndex = getArgumentInteger(2);
+#if ENABLE_ARRAYS
+		if (getHeapEntryType(tempPointer) == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			short tempPointer2 = allocateInteger(0);
+			if (getHeapEntryData(tempPointer) > 0)
+			{
+				tempPointer2 = copyConstant(readSramShort(getArrayElementAddress(tempPointer, tempEndIndex)));
+			}
+			setHeapEntryReference(argumentPointerAddressList[0], tempPointer2);
+			return;
+		}
+#endif
+#if ENABLE_PACKED_STRINGS
+		if (getHeapEntryType(tempPointer) == STRING_HEAP_ENTRY_TYPE)
+		{
+			byte tempCharacter = getStringCharacter(tempPointer, tempEndIndex);
+			setHeapEntryReference(argumentPointerAddressList[0], allocateInteger(tempCharacter));
+			return;
+		}
+#endif
+		short tempIndex = 0;
+		while (tempIndex < tempEndIndex)
+		{
+			short tempPointer2 = getHeapEntryLink(tempPointer);
+			if (tempPointer2 == 0)
+			{
+				break;
+			}
+			tempPointer = tempPointer2;
+			tempIndex += 1;
+		}
+		short tempPointer2 = copyConstant(getHeapEntryData(tempPointer));
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer2);
+	} else if (command == 25)
+	{
+		// SET.
+		short tempPointer = getMutableArgumentPointer(0);
+		short tempEndIndex = getArgumentInteger(1);
+		short tempPointer4 = copyConstant(getArgumentPointer(2));
+#if ENABLE_ARRAYS
+		if (getHeapEntryType(tempPointer) == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			if (tempEndIndex < 0)
+			{
+				tempEndIndex = 0;
+			}
+			if (tempEndIndex >= getHeapEntryData(tempPointer))
+			{
+				setArrayLength(tempPointer, tempEndIndex + 1);
+			}
+			setHeapEntryReference(getArrayElementAddress(tempPointer, tempEndIndex), tempPointer4);
+			return;
+		}
+#endif
+#if ENABLE_PACKED_STRINGS
+		if (getHeapEntryType(tempPointer) == STRING_HEAP_ENTRY_TYPE)
+		{
+			if (setStringCharacter(tempPointer, tempEndIndex, tempPointer4))
+			{
+				return;
+			}
+			convertStringToList(tempPointer);
+		}
+#endif
+		short tempIndex = 0;
+		while (tempIndex < tempEndIndex)
+		{
+			short tempPointer2 = getHeapEntryLink(tempPointer);
+			if (tempPointer2 == 0)
+			{
+				break;
+			}
+			tempPointer = tempPointer2;
+			tempIndex += 1;
+		}
+		while (tempIndex < tempEndIndex)
+		{
+			short tempPointer2 = allocateInteger(0);
+			short tempPointer3 = allocateList(tempPointer2);
+			setHeapEntryLink(tempPointer, tempPointer3);
+			tempPointer = tempPointer3;
+			tempIndex += 1;
+		}
+		setHeapEntryData(tempPointer, tempPointer4);
+	} else if (command == 26)
+	{
+		// PRINT.
+		byte tempBuffer[50];
+		short tempPointer = getArgumentPointer(0);
+		getTextFromHeapEntry(tempBuffer, tempPointer);
+		displayText(tempBuffer);
+#if ENABLE_PROFILER
+		pauseProfiling();
+#endif
+		byte tempButtons = promptButton();
+#if ENABLE_PROFILER
+		resumeProfiling();
+#endif
+		if (tempButtons & ESCAPE_BUTTON_MASK)
+		{
+			hasStoppedExecution = true;
+		}
+	} else if (command == 27)
+	{
+		// INPUT.
+		byte tempBuffer[100];
+		tempBuffer[0] = 0;
+#if ENABLE_PROFILER
+		pauseProfiling();
+#endif
+		editTextLine(tempBuffer);
+#if ENABLE_PROFILER
+		resumeProfiling();
+#endif
+		short tempPointer = allocateText(tempBuffer);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 28)
+	{
+		// ARR.
+#if ENABLE_ARRAYS
+		short tempPointer = allocateArray(getArgumentInteger(1));
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+#else
+		stopWithError(MESSAGE_14);
+#endif
+#if ENABLE_BULK_LIST_FUNCTIONS
+	} else if (command == 30)
+	{
+		// FILL.
+		short tempPointer = getMutableArgumentPointer(0);
+		if (tempValue1 <= 0)
+		{
+			return;
+		}
+		short tempType = 0;
+		if (tempPointer != 0)
+		{
+			tempType = getHeapEntryType(tempPointer);
+		}
+		short tempPointer4 = copyConstant(getArgumentPointer(2));
+#if ENABLE_ARRAYS
+		if (tempType == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			if (tempValue1 > getHeapEntryData(tempPointer))
+			{
+				setArrayLength(tempPointer, tempValue1);
+			}
+			short tempAddress = getArrayElementAddress(tempPointer, 0);
+			while (tempValue1 > 0)
+			{
+				setHeapEntryReference(tempAddress, tempPointer4);
+				tempAddress += 2;
+				tempValue1 -= 1;
+			}
+			return;
+		}
+#endif
+#if ENABLE_PACKED_STRINGS
+		if (tempType == STRING_HEAP_ENTRY_TYPE)
+		{
+			convertStringToList(tempPointer);
+		} else
+#endif
+		if (tempType != LIST_HEAP_ENTRY_TYPE)
+		{
+			tempPointer = allocateList(0);
+			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+		}
+		fillListElements(tempPointer, tempValue1, tempPointer4);
+	} else if (command == 31)
+	{
+		// COPY.
+		short tempPointer = copyHeapEntry(getArgumentPointer(1));
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 32 || command == 33)
+	{
+		// SUM.
+		// FIND.
+		short tempResult = scanIntegerElements(getArgumentPointer(1), command == 33, tempValue2);
+		short tempPointer = allocateInteger(tempResult);
+		setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
+	} else if (command == 34)
+	{
+		// REV.
+		short tempPointer = getMutableArgumentPointer(0);
+		if (tempPointer == 0)
+		{
+			return;
+		}
+		short tempType = getHeapEntryType(tempPointer);
+		if (tempType == LIST_HEAP_ENTRY_TYPE || tempType == ARRAY_HEAP_ENTRY_TYPE)
+		{
+			reverseElements(tempPointer);
+		}
+#endif
+	}
+}
+
+#if ENABLE_PROFILER
+
+// Custom functions share one profile entry.
+static void selectProfileEntry(byte command)
+{
+	if (command >= NUMBER_OF_BUILT_IN_FUNCTIONS)
+	{
+		command = CUSTOM_FUNCTION_PROFILE_INDEX;
+	}
+	profileIndex = command;
+}
+
+#endif
+
+static void __attribute__ ((noinline)) executeNextCommand()
+{
+	
+	int32_t tempNextCommandAddress;
+	fillSramData(LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET, 0, LITERAL_ARGUMENT_ADDRESS_LIST_SIZE);
+	byte shouldQuitFile = false;
+	byte tempCommandName[COMMAND_NAME_BUFFER_SIZE];
+	programReaderAddress = commandAddress;
+	readProgramWord(tempCommandName);
+	if (peekProgramByte() == 0)
+	{
+		shouldQuitFile = true;
 	}
-	tempCommandName[tempOffset] = 0;
 	byte tempCommand = findBuiltInFunction(tempCommandName);
+#if ENABLE_PROFILER
+	selectProfileEntry(tempCommand);
 	if (isIgnoringCommands)
 	{
-		while (true)
-		{
-			byte tempCharacter = readEepromByte(commandAddress + tempOffset);
-			if (tempCharacter == 0)
-			{
-				shouldQuitFile = true;
-				break;
-			}
-			if (tempCharacter == ' ' || tempCharacter == '\n')
-			{
-				break;
-			}
-			tempCommandName[tempOffset] = tempCharacter;
-			tempOffset += 1;
-		}
-		tempNextCommandAddress = commandAddress + tempOffset + 1;
-		if (tempCommand == 14 || tempCommand == 16)
+		profileIndex = SKIPPED_COMMAND_PROFILE_INDEX;
+	}
+#endif
+	if (isIgnoringCommands)
+	{
+		// Commands are skipped one word at a time.
+		tempNextCommandAddress = programReaderAddress + 1;
+		if (tempCommand == 14 || tempCommand == 16 || tempCommand == 29)
 		{
 			// IF.
 			// WHL.
+			// FOR.
 			changeFlowDataAddress(4);
 			short tempAddress = getFlowDataAddress();
 			writeSramLong(tempAddress, IGNORE_FLOW_DATA);
@@ -1455,379 +4300,491 @@ static void __attribute__ ((noinline)) executeNextCommand()
 		{
 			// END.
 			short tempAddress = getFlowDataAddress();
-			long tempFlowData = readSramLong(tempAddress);
+			int32_t tempFlowData = readSramLong(tempAddress);
 			changeFlowDataAddress(-4);
+#if ENABLE_FOR_LOOPS
+			if (tempFlowData == INTERPRET_FOR_FLOW_DATA)
+			{
+				changeFlowDataAddress(-4);
+				tempFlowData = INTERPRET_FLOW_DATA;
+			}
+#endif
 			if (tempFlowData == -1)
 			{
 				isIgnoringCommands = false;
+#if ENABLE_BLOCK_TABLE
+				if (ignoredBlockAddress >= 0)
+				{
+					setBlockEndAddress(ignoredBlockAddress, tempNextCommandAddress);
+				}
+#endif
 			}
 		}
+#if ENABLE_BLOCK_TABLE
+		if (shouldQuitFile)
+		{
+			// Ignoring continues in the caller, so the block has no end in this file.
+			ignoredBlockAddress = -1;
+		}
+#endif
 	} else {
 		byte tempArgumentIndex = 0;
-		while (true)
+		while (peekProgramByte() == ' ' && !hasStoppedExecution)
 		{
-			byte tempCharacter = readEepromByte(commandAddress + tempOffset);
-			if (tempCharacter != ' ')
+			if (tempArgumentIndex >= MAXIMUM_NUMBER_OF_ARGUMENTS)
 			{
+				stopWithError(MESSAGE_13);
 				break;
 			}
-			tempOffset = parseArgumentTerm(tempOffset + 1, tempArgumentIndex);
+			programReaderAddress += 1;
+			parseArgument(tempArgumentIndex);
 			tempArgumentIndex += 1;
 		}
-		byte tempNumberOfArguments = tempArgumentIndex;
-		tempNextCommandAddress = commandAddress + tempOffset + 1;
-		short tempValue1;
-		short tempValue2;
-		if (tempNumberOfArguments > 1)
+		if (hasStoppedExecution)
 		{
-			tempValue1 = getArgumentInteger(1);
-			if (tempNumberOfArguments > 2)
-			{
-				tempValue2 = getArgumentInteger(2);
-			}
+			// A nested expression was not valid.
+			return;
 		}
-		if (tempCommand == 0)
-		{
-			// =.
-			setHeapEntryReference(argumentPointerAddressList[0], getArgumentPointer(1));
-		} else if (tempCommand == 1)
-		{
-			// +.
-			short tempResult = tempValue1 + tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 2)
-		{
-			// -.
-			short tempResult = tempValue1 - tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 3)
-		{
-			// *.
-			short tempResult = tempValue1 * tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 4)
-		{
-			// /.
-			short tempResult = tempValue1 / tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 5)
-		{
-			// %.
-			short tempResult = tempValue1 % tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 6)
-		{
-			// ==.
-			short tempResult = tempValue1 == tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 7)
-		{
-			// >.
-			short tempResult = tempValue1 > tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 8)
-		{
-			// !.
-			short tempResult = !tempValue1;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 9)
-		{
-			// ~.
-			short tempResult = ~tempValue1;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 10)
-		{
-			// |.
-			short tempResult = tempValue1 | tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 11)
-		{
-			// &.
-			short tempResult = tempValue1 & tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 12)
-		{
-			// <<.
-			short tempResult = tempValue1 << tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 13)
-		{
-			// >>.
-			short tempResult = tempValue1 >> tempValue2;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 14)
+		byte tempNumberOfArguments = tempArgumentIndex;
+		tempNextCommandAddress = programReaderAddress + 1;
+		if (tempCommand == 14)
 		{
 			// IF.
 			short tempValue = getArgumentInteger(0);
+			int32_t tempEndAddress = -1;
 			if (!tempValue)
 			{
-				isIgnoringCommands = true;
+				tempEndAddress = getBlockEndAddress(commandAddress);
+			}
+			if (tempEndAddress >= 0)
+			{
+				tempNextCommandAddress = tempEndAddress;
+			} else {
+				if (!tempValue)
+				{
+					startIgnoringCommands();
+				}
+				changeFlowDataAddress(4);
+				short tempAddress = getFlowDataAddress();
+				writeSramLong(tempAddress, INTERPRET_FLOW_DATA);
 			}
-			changeFlowDataAddress(4);
-			short tempAddress = getFlowDataAddress();
-			writeSramLong(tempAddress, INTERPRET_FLOW_DATA);
 		} else if (tempCommand == 15)
 		{
 			// END.
 			short tempAddress = getFlowDataAddress();
-			long tempFlowData = readSramLong(tempAddress);
-			changeFlowDataAddress(-4);
-			if (tempFlowData >= 0)
+			int32_t tempFlowData = readSramLong(tempAddress);
+#if ENABLE_FOR_LOOPS
+			if (tempFlowData >= 0 && (tempFlowData & FOR_FLOW_DATA_FLAG))
+			{
+				// The counter is only updated here, and the loop does not
+				// go back to the FOR command.
+				int32_t tempLimits = readSramLong(tempAddress - 4);
+				short tempBound = tempLimits;
+				short tempStep = tempLimits >> 16;
+				short tempPointerAddress = scopeAddress + SCOPE_VARIABLE_LIST_OFFSET + (byte)(tempFlowData >> FOR_FLOW_DATA_VARIABLE_SHIFT & 0x3F) * 2;
+				short tempValue = getHeapEntryData(readReference(tempPointerAddress)) + tempStep;
+				setHeapEntryReference(tempPointerAddress, allocateInteger(tempValue));
+				if (tempStep > 0 ? tempValue < tempBound : tempValue > tempBound)
+				{
+					tempNextCommandAddress = tempFlowData & FOR_FLOW_DATA_ADDRESS_MASK;
+					shouldQuitFile = false;
+				} else {
+					changeFlowDataAddress(-8);
+				}
+			} else
+#endif
 			{
-				tempNextCommandAddress = tempFlowData;
-				shouldQuitFile = false;
+				changeFlowDataAddress(-4);
+				if (tempFlowData >= 0)
+				{
+					tempNextCommandAddress = tempFlowData;
+					shouldQuitFile = false;
+				}
 			}
 		} else if (tempCommand == 16)
 		{
 			// WHL.
-			long tempFlowData;
 			short tempValue = getArgumentInteger(0);
-			if (tempValue)
+			int32_t tempEndAddress = -1;
+			if (!tempValue)
+			{
+				tempEndAddress = getBlockEndAddress(commandAddress);
+			}
+			if (tempEndAddress >= 0)
 			{
-				tempFlowData = commandAddress;
+				tempNextCommandAddress = tempEndAddress;
 			} else {
-				tempFlowData = INTERPRET_FLOW_DATA;
-				isIgnoringCommands = true;
+				int32_t tempFlowData = commandAddress;
+				if (!tempValue)
+				{
+					tempFlowData = INTERPRET_FLOW_DATA;
+					startIgnoringCommands();
+				}
+				changeFlowDataAddress(4);
+				short tempAddress = getFlowDataAddress();
+				writeSramLong(tempAddress, tempFlowData);
 			}
-			changeFlowDataAddress(4);
-			short tempAddress = getFlowDataAddress();
-			writeSramLong(tempAddress, tempFlowData);
 		} else if (tempCommand == 17)
 		{
 			// BRK.
-			isIgnoringCommands = true;
-			short tempAddress = getFlowDataAddress();
-			while (true)
+			int32_t tempEndAddress = getBlockEndAddress(commandAddress);
+			if (tempEndAddress >= 0)
 			{
-				long tempFlowData = readSramLong(tempAddress);
-				if (tempFlowData == -1)
+				// Leave every block up to and including the loop.
+				while (true)
 				{
-					writeSramLong(tempAddress, -2);
+					int32_t tempFlowData = readSramLong(getFlowDataAddress());
+					changeFlowDataAddress(-4);
+					if (tempFlowData >= 0)
+					{
+#if ENABLE_FOR_LOOPS
+						if (tempFlowData & FOR_FLOW_DATA_FLAG)
+						{
+							changeFlowDataAddress(-4);
+						}
+#endif
+						break;
+					}
 				}
-				if (tempFlowData >= 0)
+				tempNextCommandAddress = tempEndAddress;
+			} else {
+				startIgnoringCommands();
+				short tempAddress = getFlowDataAddress();
+				while (true)
 				{
-					writeSramLong(tempAddress, -1);
-					break;
+					int32_t tempFlowData = readSramLong(tempAddress);
+					if (tempFlowData == -1)
+					{
+						writeSramLong(tempAddress, -2);
+					}
+					if (tempFlowData >= 0)
+					{
+#if ENABLE_FOR_LOOPS
+						writeSramLong(tempAddress, (tempFlowData & FOR_FLOW_DATA_FLAG) ? INTERPRET_FOR_FLOW_DATA : INTERPRET_FLOW_DATA);
+#else
+						writeSramLong(tempAddress, INTERPRET_FLOW_DATA);
+#endif
+						break;
+					}
+					tempAddress -= 4;
 				}
-				tempAddress -= 4;
 			}
 		} else if (tempCommand == 18)
 		{
 			// RET.
 			shouldQuitFile = true;
-		} else if (tempCommand == 19)
-		{
-			// RAND.
-			short tempValue = getArgumentInteger(1);
-			short tempResult = generateRandomNumber() % tempValue;
-			short tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 20)
+		} else if (tempCommand == 29)
 		{
-			// STR.
-			short tempValue = getArgumentInteger(1);
-			byte tempBuffer[20];
-			itoa(tempValue, (char *)tempBuffer, 10);
-			short tempPointer = allocateText(tempBuffer);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 21)
-		{
-			// INT.
-			byte tempBuffer[40];
-			short tempPointer = getArgumentPointer(1);
-			getTextFromHeapEntry(tempBuffer, tempPointer);
-			short tempResult = atoi((char *)tempBuffer);
-			tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 22)
-		{
-			// LEN.
-			short tempResult = 0;
-			short tempPointer = getArgumentPointer(1);
-			while (true)
+			// FOR.
+#if ENABLE_FOR_LOOPS
+			// The counter counts from the start up to the bound, which is
+			// not included. The step defaults to 1, and a negative step
+			// counts down.
+			short tempVariableOffset = argumentPointerAddressList[0] - scopeAddress - SCOPE_VARIABLE_LIST_OFFSET;
+			if (tempNumberOfArguments < 3 || tempVariableOffset < 0 || tempVariableOffset >= NUMBER_OF_SCOPE_VARIABLES * 2)
 			{
-				short tempPointer2 = getHeapEntryData(tempPointer);
-				if (tempPointer2 == 0)
-				{
-					break;
-				}
-				tempResult += 1;
-				tempPointer = getHeapEntryLink(tempPointer);
-				if (tempPointer == 0)
-				{
-					break;
-				}
+				// The counter must be a variable, because END updates it.
+				stopWithError(MESSAGE_11);
+				return;
 			}
-			tempPointer = allocateInteger(tempResult);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 23)
-		{
-			// TRUNC.
-			short tempPointer = getArgumentPointer(0);
-			short tempTargetLength = getArgumentInteger(1);
-			short tempIndex = 0;
-			while (tempIndex < tempTargetLength - 1)
+			short tempStart = getArgumentInteger(1);
+			short tempBound = getArgumentInteger(2);
+			short tempStep = 1;
+			if (tempNumberOfArguments > 3)
 			{
-				short tempPointer2 = getHeapEntryData(tempPointer);
-				if (tempPointer2 == 0)
-				{
-					break;
-				}
-				tempPointer2 = getHeapEntryLink(tempPointer);
-				if (tempPointer2 == 0)
-				{
-					break;
-				}
-				tempPointer = tempPointer2;
-				tempIndex += 1;
+				tempStep = getArgumentInteger(3);
 			}
-			if (tempTargetLength == 0)
+			setHeapEntryReference(argumentPointerAddressList[0], allocateInteger(tempStart));
+			byte tempValue = (tempStep > 0 ? tempStart < tempBound : tempStart > tempBound);
+			int32_t tempEndAddress = -1;
+			if (!tempValue)
 			{
-				setHeapEntryData(tempPointer, 0);
+				tempEndAddress = getBlockEndAddress(commandAddress);
 			}
-			setHeapEntryLink(tempPointer, 0);
-		} else if (tempCommand == 24)
-		{
-			// GET.
-			short tempPointer = getArgumentPointer(1);
-			short tempEndIndex = getArgumentInteger(2);
-			short tempIndex = 0;
-			while (tempIndex < tempEndIndex)
+			if (tempEndAddress >= 0)
 			{
-				short tempPointer2 = getHeapEntryLink(tempPointer);
-				if (tempPointer2 == 0)
-				{
-					break;
-				}
-				tempPointer = tempPointer2;
-				tempIndex += 1;
+				tempNextCommandAddress = tempEndAddress;
+			} else if (!tempValue)
+			{
+				startIgnoringCommands();
+				changeFlowDataAddress(4);
+				writeSramLong(getFlowDataAddress(), INTERPRET_FLOW_DATA);
+			} else {
+				byte tempVariableIndex = tempVariableOffset / 2;
+				int32_t tempFlowData[2];
+				tempFlowData[0] = ((int32_t)tempStep << 16) | (unsigned short)tempBound;
+				tempFlowData[1] = FOR_FLOW_DATA_FLAG | ((int32_t)tempVariableIndex << FOR_FLOW_DATA_VARIABLE_SHIFT) | tempNextCommandAddress;
+				changeFlowDataAddress(8);
+				writeSramData(getFlowDataAddress() - 4, (byte *)tempFlowData, 8);
 			}
-			short tempPointer2 = getHeapEntryData(tempPointer);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer2);
-		} else if (tempCommand == 25)
+#else
+			stopWithError(MESSAGE_14);
+			return;
+#endif
+		} else if (tempCommand == 255)
 		{
-			// SET.
-			short tempPointer = getArgumentPointer(0);
-			short tempEndIndex = getArgumentInteger(1);
-			short tempIndex = 0;
-			while (tempIndex < tempEndIndex)
+			// Custom function.
+			// Empty lines and the end of a file have no name.
+			if (tempCommandName[0] != 0)
 			{
-				short tempPointer2 = getHeapEntryLink(tempPointer);
-				if (tempPointer2 == 0)
+				byte tempFileIndex = findFileByName(tempCommandName);
+				if (tempFileIndex == 255)
 				{
-					break;
+					// Built-ins which are left out of the build end up here too.
+					stopWithError(MESSAGE_14);
+					return;
 				}
-				tempPointer = tempPointer2;
-				tempIndex += 1;
-			}
-			while (tempIndex < tempEndIndex)
-			{
-				short tempPointer2 = allocateInteger(0);
-				short tempPointer3 = allocateList(tempPointer2);
-				setHeapEntryLink(tempPointer, tempPointer3);
-				tempPointer = tempPointer3;
-				tempIndex += 1;
+				enterFunctionScope(tempNextCommandAddress, tempNumberOfArguments);
+				tempNextCommandAddress = tempFileIndex * (int32_t)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
 			}
-			short tempPointer4 = getArgumentPointer(2);
-			setHeapEntryData(tempPointer, tempPointer4);
-		} else if (tempCommand == 26)
+		} else {
+			executeBuiltInFunction(tempCommand, tempNumberOfArguments);
+		}
+	}
+	if (shouldQuitFile)
+	{
+		tempNextCommandAddress = quitFunctionScope(tempNextCommandAddress);
+	}
+	commandAddress = tempNextCommandAddress;
+	releaseLiteralArguments();
+}
+
+#if ENABLE_PROFILER
+
+static void clearProfile()
+{
+	fillSramData(PROFILE_TABLE_ADDRESS, 0, NUMBER_OF_PROFILE_ENTRIES * PROFILE_ENTRY_SIZE);
+}
+
+// Adds the totals in RAM to the profile table.
+static void flushProfileEntry()
+{
+	short tempAddress = PROFILE_TABLE_ADDRESS + profileEntryIndex * PROFILE_ENTRY_SIZE;
+	byte tempEntry[PROFILE_ENTRY_SIZE];
+	readSramData(tempEntry, PROFILE_ENTRY_SIZE, tempAddress);
+	byte tempOffset = 0;
+	while (tempOffset < PROFILE_ENTRY_SIZE)
+	{
+		*(uint32_t *)(tempEntry + tempOffset) += *(uint32_t *)(profileEntry + tempOffset);
+		*(uint32_t *)(profileEntry + tempOffset) = 0;
+		tempOffset += 4;
+	}
+	writeSramData(tempAddress, tempEntry, PROFILE_ENTRY_SIZE);
+}
+
+static void startProfiling()
+{
+	profileStartSramTransactionCount = sramTransactionCount;
+	profileStartEepromTransactionCount = eepromTransactionCount;
+	profilePausedTime = 0;
+	profileStartTime = getTimerCount();
+}
+
+// Adds the command which just ran to its profile entry.
+static void stopProfiling()
+{
+	uint32_t tempTime = getElapsedTimerCount(profileStartTime) - profilePausedTime;
+	unsigned short tempSramTransactionCount = sramTransactionCount - profileStartSramTransactionCount;
+	unsigned short tempEepromTransactionCount = eepromTransactionCount - profileStartEepromTransactionCount;
+	if (profileIndex != profileEntryIndex)
+	{
+		flushProfileEntry();
+		profileEntryIndex = profileIndex;
+	}
+	*(uint32_t *)(profileEntry + PROFILE_COUNT_OFFSET) += 1;
+	*(uint32_t *)(profileEntry + PROFILE_TIME_OFFSET) += tempTime;
+	*(uint32_t *)(profileEntry + PROFILE_SRAM_TRANSACTION_COUNT_OFFSET) += tempSramTransactionCount;
+	*(uint32_t *)(profileEntry + PROFILE_EEPROM_TRANSACTION_COUNT_OFFSET) += tempEepromTransactionCount;
+}
+
+// Destination should have size at least COMMAND_NAME_BUFFER_SIZE.
+static void getProfileEntryName(byte *destination, byte index)
+{
+	if (index >= NUMBER_OF_BUILT_IN_FUNCTIONS)
+	{
+		const byte *tempName = PROFILE_NAME_1;
+		if (index == SKIPPED_COMMAND_PROFILE_INDEX)
 		{
-			// PRINT.
-			byte tempBuffer[50];
-			short tempPointer = getArgumentPointer(0);
-			getTextFromHeapEntry(tempBuffer, tempPointer);
-			displayText(tempBuffer);
-			byte tempButtons = promptButton();
-			if (tempButtons & ESCAPE_BUTTON_MASK)
+			tempName = PROFILE_NAME_2;
+		}
+		while (true)
+		{
+			byte tempCharacter = pgm_read_byte(tempName);
+			*destination = tempCharacter;
+			if (tempCharacter == 0)
 			{
-				hasStoppedExecution = true;
+				return;
 			}
-		} else if (tempCommand == 27)
+			tempName += 1;
+			destination += 1;
+		}
+	}
+	const byte *tempName = BUILT_IN_FUNCTION_NAME_LIST;
+	while (index > 0)
+	{
+		if (pgm_read_byte(tempName) == ' ')
 		{
-			// INPUT.
-			byte tempBuffer[100];
-			tempBuffer[0] = 0;
-			editTextLine(tempBuffer);
-			short tempPointer = allocateText(tempBuffer);
-			setHeapEntryReference(argumentPointerAddressList[0], tempPointer);
-		} else if (tempCommand == 255)
+			index -= 1;
+		}
+		tempName += 1;
+	}
+	while (true)
+	{
+		byte tempCharacter = pgm_read_byte(tempName);
+		if (tempCharacter == ' ')
 		{
-			// Custom function.
-			byte tempFileIndex = 0;
-			while (tempFileIndex < NUMBER_OF_FILE_ENTRY_POSITIONS)
-			{
-				byte tempBuffer[MAXIMUM_FILE_NAME_LENGTH + 1];
-				getFileName(tempBuffer, tempFileIndex);
-				if (tempBuffer[0] != EMPTY_FILE_ENTRY_INDICATOR)
-				{
-					if (equalText(tempBuffer, tempCommandName))
-					{
-						short tempNextScopeAddress = scopeAddress + readSramShort(scopeAddress + SCOPE_SIZE_OFFSET);
-						writeSramLong(tempNextScopeAddress + SCOPE_RETURN_ADDRESS_OFFSET, tempNextCommandAddress);
-						writeSramShort(tempNextScopeAddress + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET, scopeAddress);
-						writeSramShort(tempNextScopeAddress + SCOPE_SIZE_OFFSET, SCOPE_FLOW_DATA_OFFSET);
-						scopeAddress = tempNextScopeAddress;
-						initializeScopeVariables();
-						byte tempIndex = 0;
-						while (tempIndex < tempNumberOfArguments)
-						{
-							short tempPointer = getArgumentPointer(tempIndex);
-							setHeapEntryReference(tempNextScopeAddress + SCOPE_VARIABLE_LIST_OFFSET + tempIndex * 2, tempPointer);
-							tempIndex += 1;
-						}
-						tempNextCommandAddress = tempFileIndex * (long)FILE_ENTRY_SIZE + FILE_DATA_OFFSET;
-						break;
-					}
-				}
-				tempFileIndex += 1;
-			}
+			break;
 		}
+		*destination = tempCharacter;
+		tempName += 1;
+		destination += 1;
 	}
-	if (shouldQuitFile)
+	*destination = 0;
+}
+
+#endif
+
+#if ENABLE_PROFILER || ENABLE_BUS_COUNTERS
+
+// Appends the text and returns the position after it.
+static byte appendDisplayText(byte *destination, byte position, byte *text)
+{
+	while (*text != 0 && position < DISPLAY_SIZE)
+	{
+		destination[position] = *text;
+		text += 1;
+		position += 1;
+	}
+	return position;
+}
+
+// Fills the text with spaces.
+static void clearDisplayText(byte *text)
+{
+	byte index = 0;
+	while (index < DISPLAY_SIZE)
+	{
+		text[index] = ' ';
+		index += 1;
+	}
+	text[DISPLAY_SIZE] = 0;
+}
+
+#endif
+
+#if ENABLE_PROFILER
+
+// Shows every built-in function which ran, one at a time.
+// The top row shows the name and the number of runs. The bottom row shows
+// the time in units of 1024 cycles, and the SRAM and EEPROM transactions.
+static void displayProfile()
+{
+	byte index = 0;
+	while (index < NUMBER_OF_PROFILE_ENTRIES)
 	{
-		if (scopeAddress <= STACK_OFFSET)
+		byte tempEntry[PROFILE_ENTRY_SIZE];
+		readSramData(tempEntry, PROFILE_ENTRY_SIZE, PROFILE_TABLE_ADDRESS + index * PROFILE_ENTRY_SIZE);
+		if (*(uint32_t *)(tempEntry + PROFILE_COUNT_OFFSET))
 		{
-			hasStoppedExecution = true;
-		} else {
-			byte tempIndex = 0;
-			while (tempIndex < NUMBER_OF_SCOPE_VARIABLES)
+			byte tempText[DISPLAY_SIZE + 1];
+			byte tempBuffer[COMMAND_NAME_BUFFER_SIZE];
+			clearDisplayText(tempText);
+			getProfileEntryName(tempBuffer, index);
+			byte tempPosition = appendDisplayText(tempText, 0, tempBuffer) + 1;
+			ultoa(*(uint32_t *)(tempEntry + PROFILE_COUNT_OFFSET), (char *)tempBuffer, 10);
+			appendDisplayText(tempText, tempPosition, tempBuffer);
+			ultoa(*(uint32_t *)(tempEntry + PROFILE_TIME_OFFSET) / (1024 / TIMER_PRESCALER), (char *)tempBuffer, 10);
+			tempPosition = appendDisplayText(tempText, DISPLAY_WIDTH, tempBuffer);
+			tempPosition = appendDisplayText(tempText, tempPosition, (byte *)"K S");
+			ultoa(*(uint32_t *)(tempEntry + PROFILE_SRAM_TRANSACTION_COUNT_OFFSET), (char *)tempBuffer, 10);
+			tempPosition = appendDisplayText(tempText, tempPosition, tempBuffer);
+			tempPosition = appendDisplayText(tempText, tempPosition, (byte *)" E");
+			ultoa(*(uint32_t *)(tempEntry + PROFILE_EEPROM_TRANSACTION_COUNT_OFFSET), (char *)tempBuffer, 10);
+			appendDisplayText(tempText, tempPosition, tempBuffer);
+			displayText(tempText);
+			if (promptButton() & ESCAPE_BUTTON_MASK)
 			{
-				setHeapEntryReference(scopeAddress + SCOPE_VARIABLE_LIST_OFFSET + tempIndex * 2, 0);
-				tempIndex += 1;
+				return;
 			}
-			tempNextCommandAddress = readSramLong(scopeAddress + SCOPE_RETURN_ADDRESS_OFFSET);
-			scopeAddress = readSramShort(scopeAddress + SCOPE_PREVIOUS_SCOPE_ADDRESS_OFFSET);
 		}
+		index += 1;
 	}
-	commandAddress = tempNextCommandAddress;
-	tempOffset = 0;
-	while (tempOffset < LITERAL_ARGUMENT_ADDRESS_LIST_SIZE)
+}
+
+#endif
+
+#if ENABLE_BUS_COUNTERS
+
+// Shows the counts of each device, one at a time. The top row shows
+// the device and the number of transactions. The bottom row shows
+// the bytes and the estimated bus time in milliseconds.
+static void displayBusCounters()
+{
+	byte index = 0;
+	while (index < NUMBER_OF_BUSES)
 	{
-		short tempAddress = LITERAL_ARGUMENT_ADDRESS_LIST_OFFSET + tempOffset;
-		setHeapEntryReference(tempAddress, 0);
-		tempOffset += 2;
+		byte tempText[DISPLAY_SIZE + 1];
+		byte tempBuffer[12];
+		clearDisplayText(tempText);
+		byte tempPosition = 0;
+		const byte *tempName = BUS_NAME_LIST + index * BUS_NAME_SIZE;
+		while (pgm_read_byte(tempName))
+		{
+			tempText[tempPosition] = pgm_read_byte(tempName);
+			tempName += 1;
+			tempPosition += 1;
+		}
+		ultoa(busTransactionCountList[index], (char *)tempBuffer, 10);
+		appendDisplayText(tempText, tempPosition + 1, tempBuffer);
+		ultoa(busByteCountList[index], (char *)tempBuffer, 10);
+		tempPosition = appendDisplayText(tempText, DISPLAY_WIDTH, tempBuffer);
+		tempPosition = appendDisplayText(tempText, tempPosition, (byte *)"B ");
+		uint32_t tempTime = busByteCountList[index] * SPI_BYTE_TIME + busWaitTimeList[index];
+		ultoa(tempTime / 1000, (char *)tempBuffer, 10);
+		tempPosition = appendDisplayText(tempText, tempPosition, tempBuffer);
+		appendDisplayText(tempText, tempPosition, (byte *)"MS");
+		displayText(tempText);
+		if (promptButton() & ESCAPE_BUTTON_MASK)
+		{
+			return;
+		}
+		index += 1;
 	}
+#if SRAM_CACHE_LINE_COUNT
+	byte tempText[DISPLAY_SIZE + 1];
+	byte tempBuffer[12];
+	clearDisplayText(tempText);
+	byte tempPosition = appendDisplayText(tempText, 0, (byte *)"CACHE HIT ");
+	ultoa(sramCacheHitCount, (char *)tempBuffer, 10);
+	appendDisplayText(tempText, tempPosition, tempBuffer);
+	tempPosition = appendDisplayText(tempText, DISPLAY_WIDTH, (byte *)"MISS ");
+	ultoa(sramCacheMissCount, (char *)tempBuffer, 10);
+	appendDisplayText(tempText, tempPosition, tempBuffer);
+	displayText(tempText);
+	promptButton();
+#endif
 }
 
+#endif
+
 static void __attribute__ ((noinline)) displayFileMenu(byte fileIndex)
 {
-	long tempFileAddress = fileIndex * (long)FILE_ENTRY_SIZE;
+	int32_t tempFileAddress = fileIndex * (int32_t)FILE_ENTRY_SIZE;
 	while (true)
 	{
-		byte tempResult = promptProgmemSelection(SELECTION_MENU_4, 4);
+		byte tempResult = promptProgmemSelection(SELECTION_MENU_4, sizeof(SELECTION_MENU_4) / sizeof(*SELECTION_MENU_4));
+#if ENABLE_PROFILER
+		// Profile.
+		if (tempResult == 2)
+		{
+			displayProfile();
+			continue;
+		}
+		if (tempResult > 2 && tempResult != 255)
+		{
+			tempResult -= 1;
+		}
+#endif
 		// Edit.
 		if (tempResult == 0)
 		{
@@ -1836,26 +4793,63 @@ static void __attribute__ ((noinline)) displayFileMenu(byte fileIndex)
 		// Run.
 		if (tempResult == 1)
 		{
+#if HOST_BUILD
+			hostStartRun();
+#endif
+#if ENABLE_FILE_NAME_TABLE
+			buildFileNameTable();
+#endif
+#if ENABLE_BLOCK_TABLE
+			clearBlockTable();
+#endif
+#if ENABLE_CONSTANT_TABLE
+			clearConstantTable();
+#endif
+#if ENABLE_PROFILER
+			clearProfile();
+#endif
+#if ENABLE_BUS_COUNTERS
+			clearBusCounters();
+#endif
 			scopeAddress = STACK_OFFSET;
 			writeSramShort(scopeAddress + SCOPE_SIZE_OFFSET, SCOPE_FLOW_DATA_OFFSET);
 			initializeScopeVariables();
-			heapSize = 0;
+			resetHeap();
 			isIgnoringCommands = false;
 			commandAddress = tempFileAddress + FILE_DATA_OFFSET;
 			hasStoppedExecution = false;
 			while (!hasStoppedExecution)
 			{
+#if ENABLE_PROFILER
+				startProfiling();
+#endif
 				executeNextCommand();
-				byte tempButtons = readButtons();
-				if (tempButtons & ESCAPE_BUTTON_MASK)
+#if ENABLE_PROFILER
+				stopProfiling();
+#endif
+#if ENABLE_KEYPAD_INTERRUPT
+				if (hasPendingEscapePress())
+#else
+				// The last read of the buttons left the escape button selected.
+				if (!BUTTON_OUTPUT_PIN_READ)
+#endif
 				{
 					while (readButtons())
 					{
-						
+						waitForButtons();
 					}
+#if ENABLE_KEYPAD_INTERRUPT
+					clearButtonEvents();
+#endif
 					break;
 				}
 			}
+#if ENABLE_PROFILER
+			flushProfileEntry();
+#endif
+#if HOST_BUILD
+			hostStopRun();
+#endif
 		}
 		// Delete.
 		if (tempResult == 2)
@@ -1962,7 +4956,7 @@ static void __attribute__ ((noinline)) promptCreateFile()
 	tempBuffer[0] = 0;
 	editTextLine(tempBuffer);
 	tempBuffer[FILE_DATA_OFFSET] = 0;
-	long tempFileAddress = 0;
+	int32_t tempFileAddress = 0;
 	while (true)
 	{
 		byte tempValue = readEepromByte(tempFileAddress);
@@ -1992,6 +4986,13 @@ static void displayPrimaryMenu()
 		{
 			navigateFiles();
 		}
+#if ENABLE_BUS_COUNTERS
+		// Diagnostics.
+		if (tempResult == 255)
+		{
+			displayBusCounters();
+		}
+#endif
 		// Easter egg?
 		/*
 		if (tempResult == 255)
@@ -2003,7 +5004,11 @@ static void displayPrimaryMenu()
 	}
 }
 
+#if HOST_BUILD
+int chiposMain(void)
+#else
 int main(void)
+#endif
 {
 	SCK_PIN_LOW;
 	SRAM_CS_PIN_HIGH;
@@ -2024,6 +5029,10 @@ int main(void)
 	DISPLAY_CS_PIN_OUTPUT;
 	DISPLAY_MODE_PIN_OUTPUT;
 	DISPLAY_RESET_PIN_OUTPUT;
+#if SPI_USE_USI && !HOST_BUILD
+	// Three-wire mode with a software clock strobe.
+	USICR = (1 << USIWM0);
+#endif
 	// All pins are inputs by default.
 	/*
 	MISO_PIN_INPUT;
@@ -2036,8 +5045,13 @@ int main(void)
 	BUTTON_OUTPUT_PIN_INPUT;
 	 */
 	
+#if USE_TIMER
+	initializeTimer();
+	sei();
+#endif
+	
 	DISPLAY_RESET_PIN_LOW;
-	_delay_us(50);
+	_delay_us(DISPLAY_RESET_DELAY);
 	DISPLAY_RESET_PIN_HIGH;
 	_delay_ms(100);
 
@@ -2046,14 +5060,21 @@ int main(void)
 	{
 		byte tempCommand = pgm_read_byte(DISPLAY_INITIALIZATION_COMMANDS + index);
 		sendDisplayCommand(tempCommand);
+		_delay_ms(DISPLAY_CLEAR_DELAY);
 		index += 1;
 	}
+#if ENABLE_DISPLAY_FRAMEBUFFER
+	clearDisplay();
+#endif
 	
 	// Enter SRAM sequential mode.
 	SRAM_CS_PIN_LOW;
 	sendSpiByte(0x01);
 	sendSpiByte(0x41);
 	SRAM_CS_PIN_HIGH;
+#if ENABLE_PROFILER
+	clearProfile();
+#endif
 	
 	// Disable EEPROM write protection.
 	EEPROM_CS_PIN_LOW;
@@ -2067,12 +5088,16 @@ int main(void)
 	while (!(readButtons()))
 	{
 		randomNumber += 1;
+		waitForButtons();
 	}
 	
 	while (readButtons())
 	{
-		_delay_us(50);
+		_delay_us(BUTTON_RELEASE_POLL_DELAY);
 	}
+#if ENABLE_KEYPAD_INTERRUPT
+	clearButtonEvents();
+#endif
 	
 	displayPrimaryMenu();
 	